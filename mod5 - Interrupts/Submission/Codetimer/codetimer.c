@@ -3,201 +3,608 @@
 #include <linux/proc_fs.h>
 #include <linux/list.h>
 #include <linux/string.h>
-#include <linux/timer.h>
-#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/random.h>
 #include <linux/string.h>
 #include <linux/uaccess.h>
 #include <linux/kfifo.h>
 #include <linux/workqueue.h>
 #include <linux/slab.h>
-#include <linux/vmalloc.h> 
+#include <linux/percpu.h>
+#include <linux/math64.h>
+#include <linux/ctype.h>
+#include <linux/kthread.h>
+#include <linux/irq_work.h>
+#include <linux/sched.h>
 
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("codetimer Module - Arquitectura de Linux y Android");
 MODULE_AUTHOR("d-Raco, joseignaciodg");
 
-#define CBUF_SIZE 32
-#define MAX_CHARS 40
-#define MAX_DIGS 120
-#define MAX_CODE_SIZE 8
-#define NUM_OF_LETTERS 26
-#define NUM_OF_DIGITS 10
-#define NUM_OF_CPU 2
+#define CBUF_SIZE (2*MAX_CODE_SIZE) /* Room for the longest code and its terminator, as a power of 2 */
+#define MAX_CHARS 160
+#define MAX_DIGS 512 /* Codes are copied to the user in pieces of this size */
+#define MAX_CONFIG 512
+#define MAX_CODE_SIZE 64
+#define MAX_FORMAT 128 /* Length of code_format as written, before compiling it */
+#define MAX_POOL 256 /* Characters of all the sets of a compiled format */
+#define MIN_PERIOD_NS 5000 /* Fastest generation rate, 200 kHz */
+#define MAX_CATCHUP 64 /* Most codes generated in one expiry for the periods that were missed */
+#define MAX_CODES_PER_TICK 64
+#define FLUSH_CHUNK 256 /* Bytes taken out of a staging buffer at a time */
+
+/* Where the flush work runs */
+#define FLUSH_READER 0 /* On the CPU where the reader last ran, so it finds the codes in its cache */
+#define FLUSH_UNBOUND 1 /* On any CPU, from a high priority unbound workqueue */
+
+/* How the timer hands the codes to the flush, chosen at load time */
+#define MODE_WORKQUEUE 0 /* A work in my_wq or unbound_wq */
+#define MODE_KWORKER 1 /* A kthread work in the real-time kthread worker of a CPU */
+#define MODE_IRQ_WORK 2 /* An irq_work that wakes a real-time kthread of the session */
+
+#define BENCH_BUCKETS 24 /* Latency histogram, bucket i counts flushes below 2^i us */
+
+/* Params */
+static unsigned int cbuf_size = CBUF_SIZE;
+
+module_param(cbuf_size, uint, 0444);
+MODULE_PARM_DESC(cbuf_size, "Bytes of the staging buffer of each CPU (rounded up to a power of 2)");
+
+static char *flush_mode = "workqueue";
+
+module_param(flush_mode, charp, 0444);
+MODULE_PARM_DESC(flush_mode, "How the flush is deferred: workqueue, kworker or irq_work");
+
+static bool bench = false;
+
+module_param(bench, bool, 0444);
+MODULE_PARM_DESC(bench, "Measure the generation-to-list latency and the throughput of each session, reported on release");
+
+static const char *mode_names[] = { "workqueue", "kworker", "irq_work" };
+static int flush_kind = MODE_WORKQUEUE;
 
 /* /proc entrys */
 static struct proc_dir_entry *proc_timer_entry;
 static struct proc_dir_entry *proc_config_entry;
 
-struct kfifo cbuffer; /* Circular buffer */
-struct list_head mylist; /* Linked list */
-
-/* List nodes */
-struct list_item {
-	unsigned char data[MAX_CODE_SIZE+1];
+/* The codes are kept in an arena of chunks of a page with fixed-size slots,
+instead of a list node (and a vmalloc) per code. The slots of a chunk are as long
+as the first code added to it, so short formats fit many codes in a page */
+struct code_chunk {
+	unsigned int head, tail; /* First slot not read yet and first free slot */
+	unsigned int slot, nr_slots; /* Bytes of each slot and how many fit in the chunk */
 	struct list_head links;
+	unsigned char codes[];
+};
+
+#define chunk_code(chunk, n) ((chunk)->codes + (n) * (chunk)->slot)
+
+/* A code format compiled to the set of characters of each position. A class, a [set]
+or a literal is one set, and {n} repeats it. The sets are stored once in the pool */
+struct code_pos {
+	u16 offset; /* First character of its set in the pool */
+	u16 size; /* Characters in the set, 1 for a literal */
+};
+
+struct code_pattern {
+	unsigned int length;
+	struct code_pos pos[MAX_CODE_SIZE];
+	unsigned int pool_len;
+	unsigned char pool[MAX_POOL];
+};
+
+/* Settings of a session. /proc/codeconfig holds the ones new sessions start with,
+and writing to /proc/codetimer changes the ones of that session */
+struct code_config {
+	u64 timer_period_ns; /* Measures the time (ns) of the code generation */
+	unsigned int codes_per_tick; /* Codes generated on each period */
+	unsigned int code_seed; /* Seed of the generator when seeded is set, for reproducible runs */
+	int seeded;
+	char code_format[MAX_FORMAT+1]; /* Formats de code, as it was written */
+	struct code_pattern pattern; /* code_format compiled */
+	unsigned int emergency_threshold; /* At which percentage of buffer size the data is going to be transferred to the workqueue */
+	unsigned int batch_min;
+	unsigned int flush_latency_us; /* Longest time a code waits in the staging buffer (0 = no limit) */
+	int flush_cpu;
+};
+
+struct code_config defaults = {
+	.timer_period_ns = 1000 * NSEC_PER_MSEC,
+	.codes_per_tick = 1,
+	.code_seed = 0,
+	.seeded = 0,
+	.code_format = "aA00",
+	.emergency_threshold = 75,
+	.batch_min = 1,
+	.flush_latency_us = 10000,
+	.flush_cpu = FLUSH_READER,
 };
 
-unsigned int timer_period_ms = 1000; /* Measures the time (ms) of the code generation */
-char code_format[MAX_CODE_SIZE+1] = "aA00"; /* Formats de code */
-unsigned int emergency_threshold = 75; /* At which percentage of buffer size the data is going to be transferred to the workqueue */
+/* Measures of a session in bench mode. The latency of a flush is the time since its oldest code was generated */
+struct flush_bench {
+	ktime_t start; /* When the session was opened */
+	unsigned long flushes;
+	unsigned long codes; /* Codes added to the list */
+	u64 lat_max_ns;
+	u64 dispatch_max_ns; /* Longest time from the timer asking for a flush to the flush running */
+	unsigned long lat_hist[BENCH_BUCKETS];
+};
 
-DEFINE_SPINLOCK(buffer_lock); /* Spinlock for the circular buffer */
-struct semaphore sem_list;  /* Mutex for linked list */
-struct semaphore queue;  /* Waiting queue when linked list is empty */
-int waiting; /* Number of processes waiting */
+/* Each open of /proc/codetimer is an independent generator with its own timer, buffers and list */
+struct session {
+	struct code_config cfg;
+
+	/* Staging circular buffer of each CPU. Only the timer on that CPU adds codes and only
+	the work takes them out, so it needs no lock (kfifo is safe with one reader and one writer) */
+	struct kfifo __percpu *cbuffer;
+	/* Pseudo-random generator, much cheaper than get_random_int() for every code. Only the
+	session's timer uses it, so a seed gives the same codes whatever CPU the timer runs on */
+	struct rnd_state code_rnd;
+
+	struct list_head mylist; /* Chunks of the arena */
+	unsigned int nr_codes; /* Codes in the arena */
+
+	unsigned long missed_periods; /* Periods without a code because the timer ran too late */
+	unsigned long dropped_codes; /* Codes that didn't fit in the staging buffer */
+
+	/* The flush moves flush_batch codes, adapted to the reader: smaller while a reader is waiting,
+	larger while the codes pile up unread. It's bounded by batch_min, emergency_threshold and by
+	the codes generated in flush_latency_us */
+	unsigned int flush_batch;
+	ktime_t last_flush; /* When the last flush ended */
+	unsigned long codes_read, prev_read; /* Codes taken by readers (protected by sem_list), and at the last flush */
+
+	struct semaphore sem_list;  /* Mutex for linked list */
+	struct semaphore queue;  /* Waiting queue when linked list is empty */
+	int waiting; /* Number of processes waiting */
+
+	struct work_struct my_work; /* Work descriptor */
+	struct kthread_work kwork; /* Same for MODE_KWORKER */
+	struct kthread_worker *worker; /* A kthread work can only be used with one worker, chosen at open */
+	struct irq_work irq_work; /* Same for MODE_IRQ_WORK, wakes flusher */
+	struct task_struct *flusher;
+	int flush_pending; /* The irq_work asked flusher for a flush */
+	int reader_cpu; /* CPU where the reader last ran */
+
+	struct flush_bench bench;
+	u64 __percpu *staged_at; /* When the oldest code of each staging buffer was generated */
+	u64 queued_at; /* When the timer asked for the last flush */
+
+	struct hrtimer my_timer; /* Structure that describes the high resolution timer */
+
+	int jobFinished;
+};
 
-struct work_struct my_work; /* Work descriptor */
 static struct workqueue_struct* my_wq; /* Workqueue descriptor */
+static struct workqueue_struct* unbound_wq; /* Workqueue for FLUSH_UNBOUND */
+struct semaphore sem_config; /* Mutex for changing the settings, of a session or the defaults */
+static DEFINE_PER_CPU(struct kthread_worker *, flush_worker); /* Kthread worker of each CPU for MODE_KWORKER */
 
-struct timer_list my_timer; /* Structure that describes the kernel timer */
 
-int jobFinished = 1;
 
 
+/* Appends a code to the last chunk of the arena, adding a new chunk when it's full.
+Must be called with sem_list held */
+static int arena_add(struct session *ses, const unsigned char *code) {
+	struct code_chunk *chunk = NULL;
+	unsigned int slot = strlen(code) + 1;
 
+	if (!list_empty(&ses->mylist))
+		chunk = list_last_entry(&ses->mylist, struct code_chunk, links);
 
-static void copy_items_into_list(struct work_struct *work) {
-	unsigned long flags;
-	unsigned char buffer[CBUF_SIZE], code[MAX_CODE_SIZE+1];
-	int nr_bytes, i, j = 0, r;
-	struct list_item *node;
-	
-	spin_lock_irqsave(&buffer_lock, flags);
+	/* A longer code than the slots of the last chunk, after a change of format,
+	needs a new chunk unless that one is empty */
+	if (!chunk || chunk->tail == chunk->nr_slots || (chunk->slot < slot && chunk->tail > 0)) {
+		if (!(chunk = kmalloc(PAGE_SIZE, GFP_KERNEL)))
+			return -ENOMEM;
+
+		chunk->head = chunk->tail = 0;
+		list_add_tail(&chunk->links, &ses->mylist);
+	}
+
+	if (chunk->tail == 0) {
+		chunk->slot = slot;
+		chunk->nr_slots = (PAGE_SIZE - sizeof(struct code_chunk)) / slot;
+	}
+
+	strcpy(chunk_code(chunk, chunk->tail++), code);
+	ses->nr_codes++;
 
-	/* Critical section where the buffer is accessed in porcess context */
-	nr_bytes = kfifo_out(&cbuffer, buffer, kfifo_len(&cbuffer));
+	return 0;
+}
+
+/* Length of the oldest code. Must be called with sem_list held and nr_codes > 0 */
+static int arena_next_len(struct session *ses) {
+	struct code_chunk *chunk = list_first_entry(&ses->mylist, struct code_chunk, links);
+
+	return strlen(chunk_code(chunk, chunk->head));
+}
 
-	spin_unlock_irqrestore(&buffer_lock, flags);
+/* Takes the oldest code out of the arena. A chunk is freed once it has been read whole,
+the last one is kept for the next codes. Must be called with sem_list held and nr_codes > 0 */
+static void arena_pop(struct session *ses, unsigned char *code) {
+	struct code_chunk *chunk = list_first_entry(&ses->mylist, struct code_chunk, links);
 
-	while(j < nr_bytes && j < CBUF_SIZE) {
-		i = 0;
+	strcpy(code, chunk_code(chunk, chunk->head++));
+	ses->nr_codes--;
 
-		while(buffer[j] != '\0' && j < CBUF_SIZE) {
-			code[i++] = buffer[j++];
+	if (chunk->head == chunk->tail) {
+		if (list_is_singular(&ses->mylist))
+			chunk->head = chunk->tail = 0;
+		else {
+			list_del(&chunk->links);
+			kfree(chunk);
 		}
-		code[i] = '\0';
-		j++;
+	}
+}
 
-		node = vmalloc(sizeof(struct list_item));
-		strcpy(node->data, code);
 
-		/* "Acquires" the mutex */
-		r = down_interruptible(&sem_list);
+/* Adds the codes of a piece of a staging buffer to the list. A code cut at the end
+of the piece is kept in code and i, and completed with the next piece.
+Returns the number of codes added */
+static unsigned int copy_codes(struct session *ses, unsigned char *buffer, int nr_bytes, unsigned char *code, int *i) {
+	unsigned int added = 0;
+	int j;
+
+	/* "Acquires" the mutex */
+	if (down_interruptible(&ses->sem_list))
+		return 0;
+
+	for(j = 0; j < nr_bytes; ++j) {
+		if(buffer[j] != '\0') {
+			if(*i < MAX_CODE_SIZE)
+				code[(*i)++] = buffer[j];
+			continue;
+		}
+
+		code[*i] = '\0';
+		*i = 0;
+
+		/* Adds the code at the end of the arena */
+		if (arena_add(ses, code))
+			ses->dropped_codes++;
+		else {
+			added++;
+			printk_ratelimited(KERN_INFO "codetimer: Copied %s\n", code);
+		}
+	}
+
+	/* "Frees" the mutex */
+	up(&ses->sem_list);
+
+	return added;
+}
+
+
+/* Moves a staging buffer into the list. Only what it held when called, plus the rest of
+the last code a byte at a time, so it ends even if the timer keeps on filling it */
+static unsigned int flush_staging(struct session *ses, struct kfifo *staging) {
+	unsigned char buffer[FLUSH_CHUNK], code[MAX_CODE_SIZE+1];
+	unsigned int left = kfifo_len(staging), nr_bytes, added = 0;
+	int i = 0;
+
+	while((left > 0 || i > 0) && (nr_bytes = kfifo_out(staging, buffer, min_t(unsigned int, FLUSH_CHUNK, left ? left : 1))) > 0) {
+		left -= min(left, nr_bytes);
+		added += copy_codes(ses, buffer, nr_bytes, code, &i);
+	}
+
+	return added;
+}
+
+
+/* Adapts the size of the next flushes to the reader, after added codes were flushed */
+static void adapt_flush(struct session *ses, unsigned int added) {
+	struct code_config *cfg = &ses->cfg;
+	unsigned int code_bytes = cfg->pattern.length + 1;
+	unsigned int batch_max, batch_lat;
+	unsigned long drained;
+	ktime_t now = ktime_get();
+	s64 elapsed = ktime_us_delta(now, ses->last_flush);
+
+	ses->last_flush = now;
+	drained = ses->codes_read - ses->prev_read;
+	ses->prev_read = ses->codes_read;
+
+	/* A reader waiting for codes keeps up with the generation: smaller batches to cut
+	its latency. Codes piling up unread: larger batches, the reader is in no hurry */
+	if(ses->waiting > 0)
+		ses->flush_batch /= 2;
+	else if(drained < added)
+		ses->flush_batch *= 2;
+
+	/* A batch can't take longer than flush_latency_us to be generated... */
+	if(cfg->flush_latency_us && elapsed > 0) {
+		batch_lat = div64_s64((s64)added * cfg->flush_latency_us, elapsed);
+		ses->flush_batch = min(ses->flush_batch, batch_lat);
+	}
 
-		/* Adds the node at the end of the list */
-		list_add_tail(&node->links, &mylist);
+	/* ...nor fill the staging buffer beyond the emergency threshold */
+	batch_max = (cbuf_size * cfg->emergency_threshold) / 100 / code_bytes;
+	ses->flush_batch = clamp(ses->flush_batch, cfg->batch_min, max(cfg->batch_min, batch_max));
+}
+
+
+/* Accounts a flush in bench mode */
+static void bench_flush(struct session *ses, u64 oldest, u64 start, unsigned int added) {
+	struct flush_bench *b = &ses->bench;
+	u64 lat = ktime_get_ns() - oldest;
+	u64 queued_at = READ_ONCE(ses->queued_at);
+
+	b->flushes++;
+	b->codes += added;
+	b->lat_max_ns = max(b->lat_max_ns, lat);
+	b->lat_hist[min_t(int, fls64(div_u64(lat, NSEC_PER_USEC)), BENCH_BUCKETS-1)]++;
+
+	if (start > queued_at)
+		b->dispatch_max_ns = max(b->dispatch_max_ns, start - queued_at);
+}
+
+/* Upper bound (us) of the latency of pct percent of the flushes */
+static u64 bench_percentile(struct flush_bench *b, unsigned int pct) {
+	unsigned long count = 0;
+	int i;
+
+	for (i = 0; i < BENCH_BUCKETS-1; ++i) {
+		count += b->lat_hist[i];
+		if (count * 100 >= (u64)b->flushes * pct)
+			break;
+	}
+
+	return 1ULL << i;
+}
+
+static void bench_report(struct session *ses) {
+	struct flush_bench *b = &ses->bench;
+	s64 elapsed = ktime_us_delta(ktime_get(), b->start);
+
+	if (!b->flushes || elapsed <= 0)
+		return;
+
+	printk(KERN_INFO "codetimer: Bench %s: %lu codes in %lu flushes, %lld codes/s, "
+	       "latency p50 < %lluus p99 < %lluus max %lluus, dispatch max %lluus\n",
+	       mode_names[flush_kind], b->codes, b->flushes,
+	       div64_s64((s64)b->codes * USEC_PER_SEC, elapsed),
+	       bench_percentile(b, 50), bench_percentile(b, 99),
+	       div_u64(b->lat_max_ns, NSEC_PER_USEC), div_u64(b->dispatch_max_ns, NSEC_PER_USEC));
+}
 
-		/* "Frees" the mutex */
-		up(&sem_list);
-		printk(KERN_INFO "codetimer: Copied %s\n", code);
+/* Moves the codes of the staging buffers to the list, whatever deferred it */
+static void flush_session(struct session *ses) {
+	struct kfifo *staging;
+	unsigned int added = 0;
+	u64 start = 0, oldest = U64_MAX;
+	int cpu;
+
+	if (bench)
+		start = ktime_get_ns();
+
+	/* Merges the staging buffers of every CPU. The timers go on adding codes meanwhile,
+	always whole ones, since each is added with a single kfifo_in() */
+	for_each_possible_cpu(cpu) {
+		staging = per_cpu_ptr(ses->cbuffer, cpu);
+
+		if (bench && !kfifo_is_empty(staging))
+			oldest = min(oldest, *per_cpu_ptr(ses->staged_at, cpu));
+
+		added += flush_staging(ses, staging);
 	}
 
-	if(waiting > 0){
-		waiting--;
-		up(&queue);
+	adapt_flush(ses, added);
+
+	if (bench && added)
+		bench_flush(ses, oldest, start, added);
+
+	if(ses->waiting > 0){
+		ses->waiting--;
+		up(&ses->queue);
 	}
 
 	printk(KERN_INFO "codetimer: Copied items to the list.\n");
 
-	jobFinished = 1;
+	ses->jobFinished = 1;
 }
 
+static void copy_items_into_list(struct work_struct *work) {
+	flush_session(container_of(work, struct session, my_work));
+}
 
-/* Function invoked when timer expires (fires) */
-static void fire_timer(unsigned long data) {
-	unsigned int random;
-	unsigned char c;
-	unsigned char code[MAX_CODE_SIZE+1];
-	int code_length = strlen(code_format);
-	int i = 0, cpu, cpu_actual = smp_processor_id();
-
-	/* Generates a random number of 32 bits */ 
-	random = get_random_int();
-
-	/* Create code from random int */
-	while(i < code_length) {
-		if(code_format[i] == 'A') {
-			/* Upper case ASCII: 65-90 (A-Z) */
-			if(random < NUM_OF_LETTERS)
-				random = get_random_int();
-				
-			c = (unsigned char)(65 + (random % NUM_OF_LETTERS));
-			random /= NUM_OF_LETTERS;
-		}
-		else if(code_format[i] == 'a') {
-			/* Lower case ASCII: 97-122 (a-z) */
-			if(random < NUM_OF_LETTERS)
-				random = get_random_int();
+static void kwork_flush(struct kthread_work *work) {
+	flush_session(container_of(work, struct session, kwork));
+}
 
-			c = (unsigned char)(97 + (random % NUM_OF_LETTERS));
-			random /= NUM_OF_LETTERS;
-		}
-		else {
-			/* Number ASCII: 48-57 (0-9) */
-			if(random < NUM_OF_DIGITS)
-				random = get_random_int();
+/* The timer only raises the irq_work, so the wakeup doesn't happen inside the hrtimer */
+static void irq_work_flush(struct irq_work *work) {
+	struct session *ses = container_of(work, struct session, irq_work);
 
-			c = (unsigned char)(48 + (random % NUM_OF_DIGITS));
-			random /= NUM_OF_DIGITS;
+	WRITE_ONCE(ses->flush_pending, 1);
+	wake_up_process(ses->flusher);
+}
+
+/* Kthread of a session in MODE_IRQ_WORK */
+static int flusher_thread(void *data) {
+	struct session *ses = data;
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		if (kthread_should_stop())
+			break;
+
+		if (!READ_ONCE(ses->flush_pending)) {
+			schedule();
+			continue;
 		}
 
-		code[i++] = c;
+		__set_current_state(TASK_RUNNING);
+		WRITE_ONCE(ses->flush_pending, 0);
+		flush_session(ses);
 	}
-	code[code_length] = '\0';
 
-	/* Acquire the spin lock */
-	spin_lock(&buffer_lock);
+	__set_current_state(TASK_RUNNING);
 
-	kfifo_in(&cbuffer, code, code_length+1);
+	return 0;
+}
 
-	/* Free the spin lock */
-	spin_unlock(&buffer_lock);
+/* The dedicated flush threads are real-time, so no other task delays the flush */
+static void flusher_priority(struct task_struct *task) {
+	struct sched_param param = { .sched_priority = 1 };
 
-	/* If the buffer fills up to the emergency threshold, transfer the codes to the linked list */
-	if(((CBUF_SIZE * emergency_threshold) / 100) <= (kfifo_len(&cbuffer)) && jobFinished) {
-		cpu = cpu_actual + 1;
-		if(cpu >= NUM_OF_CPU)
-			cpu = 0;
+	sched_setscheduler(task, SCHED_FIFO, &param);
+}
 
-		jobFinished = 0;
+/* Hands the codes to the flush, with the mechanism chosen at load time */
+static void start_flush(struct session *ses, int cpu_actual) {
+	int cpu;
 
-	  	/* Enqueue work */
-	  	queue_work_on(cpu, my_wq, &my_work);
+	if (bench)
+		WRITE_ONCE(ses->queued_at, ktime_get_ns());
+
+	if (flush_kind == MODE_IRQ_WORK) {
+		irq_work_queue(&ses->irq_work);
+		return;
+	}
+
+	/* Always the worker of the session, flush_cpu doesn't apply */
+	if (flush_kind == MODE_KWORKER) {
+		kthread_queue_work(ses->worker, &ses->kwork);
+		return;
+	}
 
+	if (ses->cfg.flush_cpu == FLUSH_UNBOUND) {
+		queue_work(unbound_wq, &ses->my_work);
+		return;
 	}
 
-	printk(KERN_INFO "codetimer: Fire timer %s\n", code);
+	/* Here if there's no reader yet */
+	cpu = READ_ONCE(ses->reader_cpu);
+	if (cpu < 0 || !cpu_online(cpu))
+		cpu = cpu_actual;
 
-  	/* Re-activate the timer timer_period_ms milliseconds from now */
-	mod_timer(&(my_timer), jiffies + (HZ*timer_period_ms)/1000); 
+	queue_work_on(cpu, my_wq, &ses->my_work);
 }
 
 
+/* Seeds the generator of the session, from the configured seed or with random bytes */
+static void seed_generator(struct session *ses) {
+	u64 seed;
 
+	if (ses->cfg.seeded)
+		seed = ses->cfg.code_seed;
+	else
+		get_random_bytes(&seed, sizeof(seed));
 
+	prandom_seed_state(&ses->code_rnd, seed);
+}
 
-/* Empties the list */
-void cleanup(void){
-	int r;
 
+/* Picks a character of the set of a position from 16 random bits. The bias of
+multiplying instead of a modulo is below size/65536 */
+#define pick_char(pat, p, r) ((pat)->pool[(p)->offset + (((r) * (p)->size) >> 16)])
+
+/* Creates a code following the compiled format, two positions per random number
+and the same steps for every kind of position */
+static int generate_code(const struct code_pattern *pat, unsigned char *code, struct rnd_state *rnd) {
+	const struct code_pos *p = pat->pos;
+	unsigned int random;
+	int i;
+
+	for(i = 0; i + 1 < pat->length; i += 2, p += 2) {
+		random = prandom_u32_state(rnd);
+		code[i] = pick_char(pat, p, random & 0xffff);
+		code[i+1] = pick_char(pat, p + 1, random >> 16);
+	}
+
+	/* Odd length */
+	if(i < pat->length)
+		code[i] = pick_char(pat, p, prandom_u32_state(rnd) & 0xffff);
+
+	code[pat->length] = '\0';
+
+	return pat->length;
+}
+
+
+/* Function invoked when timer expires (fires) */
+static enum hrtimer_restart fire_timer(struct hrtimer *timer) {
+	struct session *ses = container_of(timer, struct session, my_timer);
+	struct code_config *cfg = &ses->cfg;
+	unsigned char code[MAX_CODE_SIZE+1];
+	int code_length = cfg->pattern.length;
+	int cpu_actual = smp_processor_id();
+	struct kfifo *staging = this_cpu_ptr(ses->cbuffer);
+	struct rnd_state *rnd = &ses->code_rnd;
+	unsigned int queued;
+	u64 periods, n, total;
+
+	/* Next expiry is a whole number of periods after the previous one, not after now,
+	so the rate doesn't drift. periods > 1 when the timer ran late and some were missed */
+	periods = hrtimer_forward_now(timer, ns_to_ktime(cfg->timer_period_ns));
+
+	/* One code per elapsed period, up to MAX_CATCHUP */
+	if (periods > MAX_CATCHUP) {
+		ses->missed_periods += periods - MAX_CATCHUP;
+		periods = MAX_CATCHUP;
+	}
+
+	total = periods * cfg->codes_per_tick;
+
+	/* The codes added now are the oldest of the buffer */
+	if (bench && total > 0 && kfifo_is_empty(staging))
+		*this_cpu_ptr(ses->staged_at) = ktime_get_ns();
+
+	for (n = 0; n < total; ++n) {
+		/* Codes are only added whole, so the work never sees half of one */
+		if (kfifo_avail(staging) < code_length+1) {
+			ses->dropped_codes += total - n;
+			break;
+		}
+
+		generate_code(&cfg->pattern, code, rnd);
+		kfifo_in(staging, code, code_length+1);
+	}
+
+	/* If the buffer holds a whole batch, reaches the emergency threshold or its oldest code
+	may have waited for flush_latency_us, transfer the codes to the linked list */
+	queued = kfifo_len(staging);
+	if(queued > 0 && ses->jobFinished && (queued >= ses->flush_batch * (code_length+1)
+			|| ((kfifo_size(staging) * cfg->emergency_threshold) / 100) <= queued
+			|| (cfg->flush_latency_us && ktime_us_delta(ktime_get(), ses->last_flush) >= cfg->flush_latency_us))) {
+		ses->jobFinished = 0;
+
+	  	/* Enqueue work */
+		start_flush(ses, cpu_actual);
+	}
+
+	/* At high rates printing every code would take longer than generating it */
+	if (n > 0)
+		printk_ratelimited(KERN_INFO "codetimer: Fire timer %s\n", code);
+
+	/* Re-activate the timer */
+	return HRTIMER_RESTART;
+}
+
+
+
+
+
+/* Empties the list */
+void cleanup(struct session *ses){
 	/* Variables needed for the for loop */
-	struct list_head *aux = NULL, *pos = NULL;
-	/* Node to be freed */
-	struct list_item *freeNode = NULL;
+	struct code_chunk *chunk = NULL, *aux = NULL;
 
 	/* "Acquires" the mutex */
-	r = down_interruptible(&sem_list);
+	down(&ses->sem_list);
 	
-	/* Delete all nodes from the list and frees space */
-	list_for_each_safe(pos, aux, &mylist){
-		freeNode = list_entry(pos, struct list_item, links);
-		list_del(pos);
-		vfree(freeNode);
+	/* Frees the arena a chunk at a time */
+	list_for_each_entry_safe(chunk, aux, &ses->mylist, links){
+		list_del(&chunk->links);
+		kfree(chunk);
 	}
+	ses->nr_codes = 0;
 
 	/* "Frees" the mutex */
-  	up(&sem_list);
+  	up(&ses->sem_list);
 
 	printk(KERN_INFO "codetimer: Cleaned the whole list.\n");
 }
@@ -208,26 +615,125 @@ void cleanup(void){
 
 
 
+/* Frees the circular buffers of a session that were allocated */
+static void free_buffers(struct session *ses) {
+    int cpu;
+
+    if (!ses->cbuffer)
+        return;
+
+    for_each_possible_cpu(cpu) {
+        if (kfifo_initialized(per_cpu_ptr(ses->cbuffer, cpu)))
+            kfifo_free(per_cpu_ptr(ses->cbuffer, cpu));
+    }
+    free_percpu(ses->cbuffer);
+}
+
+static void free_session(struct session *ses) {
+    free_buffers(ses);
+    free_percpu(ses->staged_at);
+    kfree(ses);
+}
+
+static struct session *alloc_session(void) {
+    struct session *ses;
+    int cpu;
+
+    if (!(ses = kzalloc(sizeof(struct session), GFP_KERNEL)))
+        return NULL;
+
+    /* Per-CPU data is zeroed, so the kfifos read as not initialized */
+    ses->cbuffer = alloc_percpu(struct kfifo);
+    ses->staged_at = alloc_percpu(u64);
+    if (!ses->cbuffer || !ses->staged_at) {
+        free_session(ses);
+        return NULL;
+    }
+
+    /* Circular buffers initialization */
+    for_each_possible_cpu(cpu) {
+        if (kfifo_alloc(per_cpu_ptr(ses->cbuffer, cpu),cbuf_size,GFP_KERNEL)) {
+            free_session(ses);
+            return NULL;
+        }
+    }
+
+    down(&sem_config);
+    ses->cfg = defaults;
+    up(&sem_config);
+    ses->flush_batch = ses->cfg.batch_min;
+    ses->reader_cpu = -1;
+    ses->jobFinished = 1;
+
+    /* Initialize the list */
+    INIT_LIST_HEAD(&ses->mylist);
+
+    /* Initializing the waiting queue semaphore to 0 */
+    sema_init(&ses->queue, 0);
+    ses->waiting = 0;
+
+    /* Initializing the semaphore that allows mutual exclusion of the linked list to 1 */
+    sema_init(&ses->sem_list, 1);
+
+    return ses;
+}
+
 static int timerproc_open(struct inode *i, struct file *file) {
+	struct session *ses;
+
 	/* Increment the Reference Counter of the module */
 	try_module_get(THIS_MODULE);
 
-	/* Create a private workqueue named 'my_queue' */
-	my_wq = create_workqueue("my_queue");
+	/* Every open gets its own generator */
+	if (!(ses = alloc_session())) {
+		module_put(THIS_MODULE);
+		return -ENOMEM;
+	}
+	file->private_data = ses;
 
 	/* Initialize work structure (with function) */
-	INIT_WORK(&my_work, copy_items_into_list);
+	INIT_WORK(&ses->my_work, copy_items_into_list);
+	kthread_init_work(&ses->kwork, kwork_flush);
+
+	/* The worker of the CPU of the opener, usually the reader. CPUs brought up
+	after loading have none, then the first one there is */
+	if (flush_kind == MODE_KWORKER) {
+		int cpu;
+
+		if (!(ses->worker = per_cpu(flush_worker, raw_smp_processor_id()))) {
+			for_each_possible_cpu(cpu) {
+				if ((ses->worker = per_cpu(flush_worker, cpu)))
+					break;
+			}
+		}
+	}
+	init_irq_work(&ses->irq_work, irq_work_flush);
+
+	if (flush_kind == MODE_IRQ_WORK) {
+		ses->flusher = kthread_run(flusher_thread, ses, "codetimer_flush");
+		if (IS_ERR(ses->flusher)) {
+			int r = PTR_ERR(ses->flusher);
+
+			free_session(ses);
+			module_put(THIS_MODULE);
+			return r;
+		}
+		flusher_priority(ses->flusher);
+	}
+
+	/* Same codes on every open when there's a seed */
+	seed_generator(ses);
 
 	/* Create timer */
-    init_timer(&my_timer);
+    hrtimer_init(&ses->my_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 
     /* Initialize field */
-    my_timer.data = 0;
-    my_timer.function = fire_timer;
-    my_timer.expires = jiffies + (HZ*timer_period_ms)/1000;  /* Activate it timer_period_ms milliseconds from now */
+    ses->my_timer.function = fire_timer;
+
+    ses->last_flush = ses->bench.start = ktime_get();
 
-    /* Activate the timer for the first time */
-    add_timer(&my_timer); 
+    /* Activate the timer for the first time, timer_period_ns nanoseconds from now */
+    hrtimer_start(&ses->my_timer, ns_to_ktime(ses->cfg.timer_period_ns), HRTIMER_MODE_REL);
 
     printk(KERN_INFO "codetimer: Open.\n");
 
@@ -235,20 +741,30 @@ static int timerproc_open(struct inode *i, struct file *file) {
 }
 
 static int timerproc_release(struct inode *i, struct file *file) {
+	struct session *ses = file->private_data;
+
 	/* Wait until completion of the timer function (if it's currently running) and delete timer */
-  	del_timer_sync(&my_timer);
+  	hrtimer_cancel(&ses->my_timer);
 
-	/* Wait until all jobs scheduled so far have finished */
-    flush_workqueue(my_wq);
+	/* Wait until the job scheduled so far has finished */
+	cancel_work_sync(&ses->my_work);
+	kthread_cancel_work_sync(&ses->kwork);
+	irq_work_sync(&ses->irq_work);
+	if (ses->flusher)
+		kthread_stop(ses->flusher);
 
-  	/* Destroy workqueue resources */
-  	destroy_workqueue(my_wq);
+	if (bench)
+		bench_report(ses);
 
-  	/* Delete elements of the circular buffer */
-    kfifo_reset(&cbuffer);
+    /* The statistics of the session are lost with it */
+    printk(KERN_INFO "codetimer: Session stats: flush_batch=%u missed_periods=%lu dropped_codes=%lu\n",
+           ses->flush_batch, ses->missed_periods, ses->dropped_codes);
 
     /* Delete elements of the linked list */
-    cleanup();
+    cleanup(ses);
+
+    /* Delete the circular buffers */
+    free_session(ses);
 
     /* Decrement the Reference Counter of the module */
 	module_put(THIS_MODULE);
@@ -259,77 +775,118 @@ static int timerproc_release(struct inode *i, struct file *file) {
 }
 
 static ssize_t timerproc_read(struct file *file, char *buff, size_t len, loff_t *off) {
+	struct session *ses = file->private_data;
 	char kbuf[MAX_DIGS];
     int nr_bytes = 0;
-    /* Variable needed for the loop */
-	struct list_head *pos = NULL;
-	/* Variable that will retrieve the node */
-	struct list_item *node = NULL;
+    size_t copied = 0;
 	unsigned char data[MAX_CODE_SIZE+1];
 
+	/* The next flushes go to this CPU */
+	WRITE_ONCE(ses->reader_cpu, raw_smp_processor_id());
+
   	/* "Acquires" the mutex */
-	if (down_interruptible(&sem_list))
+	if (down_interruptible(&ses->sem_list))
 		return -EINTR;
 
   	/* Blocks until the list has been filled */
-  	while(list_empty(&mylist)) {
-  		waiting++;
+  	while(ses->nr_codes == 0) {
+  		ses->waiting++;
 
   		/* "Frees" the mutex */
-  		up(&sem_list);
+  		up(&ses->sem_list);
 
   		/* Blocks in the queue */
-		if (down_interruptible(&queue)){
-			down(&sem_list);
-			waiting--;
-			up(&sem_list);
+		if (down_interruptible(&ses->queue)){
+			down(&ses->sem_list);
+			ses->waiting--;
+			up(&ses->sem_list);
 			return -EINTR;
 		}
 
+		/* It may have woken up somewhere else */
+		WRITE_ONCE(ses->reader_cpu, raw_smp_processor_id());
+
 		/* "Acquires" the mutex */
-		if (down_interruptible(&sem_list))
+		if (down_interruptible(&ses->sem_list))
 			return -EINTR;
   	}
 
-  	/* Traverse the hole list and stores the data. 
+  	/* Takes the codes out of the arena while they fit in the user buffer, a kbuf at a time,
+	the rest are left for the next read. They are consumed as they are copied, so a plain
+	seq_file, which may show a record again when it doesn't fit, would lose or repeat codes.
 	The data is stored by digits, and a \n when a number ends. */
-	list_for_each(pos, &mylist) {
-		node = list_entry(pos, struct list_item, links);
-		strncpy(data, node->data, MAX_CODE_SIZE+1);
+	for(;;) {
+		nr_bytes = 0;
 
-		nr_bytes += snprintf((kbuf+nr_bytes), MAX_CODE_SIZE+2, "%s\n", data);
-	}
+		while(ses->nr_codes > 0 && nr_bytes + MAX_CODE_SIZE+2 <= MAX_DIGS
+				&& copied + nr_bytes + arena_next_len(ses) + 1 <= len) {
+			arena_pop(ses, data);
+			ses->codes_read++;
 
-  	/* "Frees" the mutex */
-  	up(&sem_list);
-  	
-  	cleanup();
+			nr_bytes += snprintf((kbuf+nr_bytes), MAX_CODE_SIZE+2, "%s\n", data);
+		}
 
-    if(len < nr_bytes)
+		/* "Frees" the mutex, the work can go on adding codes while they are copied */
+		up(&ses->sem_list);
+
+		if(nr_bytes == 0)
+			break;
+
+		if(copy_to_user(buff+copied, kbuf, nr_bytes))
+			return copied ? copied : -EFAULT;
+
+		copied += nr_bytes;
+
+		/* "Acquires" the mutex */
+		if (down_interruptible(&ses->sem_list))
+			break;
+	}
+
+	/* Not even one code fits */
+    if(copied == 0)
         return -ENOSPC;
 
-    if(copy_to_user(buff, kbuf, nr_bytes))
-        return -EFAULT;
-    
-    *off += nr_bytes; 
+    *off += copied; 
 
     printk(KERN_INFO "codetimer: Read.\n");
 
+    return copied;
+}
+
+/* Prints a configuration */
+static int print_config(char *kbuf, struct code_config *cfg) {
+    int nr_bytes = 0;
+
+    nr_bytes += snprintf((kbuf+nr_bytes), MAX_CONFIG-nr_bytes, "timer_period_ns = %llu\n", cfg->timer_period_ns);
+    nr_bytes += snprintf((kbuf+nr_bytes), MAX_CONFIG-nr_bytes, "emergency_threshold = %u\n", cfg->emergency_threshold);
+    nr_bytes += snprintf((kbuf+nr_bytes), MAX_CONFIG-nr_bytes, "code_format = %s\n", cfg->code_format);
+    nr_bytes += snprintf((kbuf+nr_bytes), MAX_CONFIG-nr_bytes, "cbuf_size = %u\n", cbuf_size);
+    nr_bytes += snprintf((kbuf+nr_bytes), MAX_CONFIG-nr_bytes, "flush_latency_us = %u\n", cfg->flush_latency_us);
+    nr_bytes += snprintf((kbuf+nr_bytes), MAX_CONFIG-nr_bytes, "batch_min = %u\n", cfg->batch_min);
+    nr_bytes += snprintf((kbuf+nr_bytes), MAX_CONFIG-nr_bytes, "flush_cpu = %s\n", (cfg->flush_cpu == FLUSH_UNBOUND) ? "unbound" : "reader");
+    nr_bytes += snprintf((kbuf+nr_bytes), MAX_CONFIG-nr_bytes, "codes_per_tick = %u\n", cfg->codes_per_tick);
+    if (cfg->seeded)
+        nr_bytes += snprintf((kbuf+nr_bytes), MAX_CONFIG-nr_bytes, "seed = %u\n", cfg->code_seed);
+    else
+        nr_bytes += snprintf((kbuf+nr_bytes), MAX_CONFIG-nr_bytes, "seed = random\n");
+
     return nr_bytes;
 }
 
 static ssize_t configproc_read(struct file *file, char *buff, size_t len, loff_t *off) {
-    char kbuf[MAX_DIGS];
+    char kbuf[MAX_CONFIG];
     int nr_bytes = 0;
 
     /* Tell the application that there is nothing left to read */
     if ((*off) > 0) 
       return 0;
 
-    nr_bytes += snprintf((kbuf+nr_bytes), MAX_DIGS, "timer_period_ms = %u\n", timer_period_ms);
-    nr_bytes += snprintf((kbuf+nr_bytes), MAX_DIGS, "emergency_threshold = %u\n", emergency_threshold);
-    nr_bytes += snprintf((kbuf+nr_bytes), MAX_DIGS, "code_format = %s\n", code_format);
+    if(down_interruptible(&sem_config))
+        return -EINTR;
 
+    nr_bytes = print_config(kbuf, &defaults);
+
+    up(&sem_config);
 
     if(len < nr_bytes)
         return -ENOSPC;
@@ -344,39 +901,236 @@ static ssize_t configproc_read(struct file *file, char *buff, size_t len, loff_t
     return nr_bytes;
 }
 
-static ssize_t configproc_write(struct file *file, const char *buff, size_t len, loff_t *off) {
-    /* Private copy of the data in kernel space */
-    char kbuf[MAX_CHARS];
-    char aux[MAX_CHARS];
-    unsigned int num;
-    int i;
+/* Adds the characters of a set to the pool, or finds them there, and returns where they start */
+static int pool_add(struct code_pattern *pat, const unsigned char *set, int size) {
+    int offset;
 
-    if(len > MAX_CHARS)
-        return -ENOSPC;
+    for(offset = 0; offset + size <= pat->pool_len; ++offset) {
+        if(memcmp(pat->pool + offset, set, size) == 0)
+            return offset;
+    }
 
-    /* Transfer user data to kernel space */
-    if(copy_from_user(kbuf, buff, len))
-        return -EFAULT;
+    if(pat->pool_len + size > MAX_POOL)
+        return -EINVAL;
 
-    kbuf[len] = '\0';
+    offset = pat->pool_len;
+    memcpy(pat->pool + offset, set, size);
+    pat->pool_len += size;
+
+    return offset;
+}
+
+/* Adds the printable characters from lo to hi to a set */
+static int add_range(bool *in_set, unsigned char lo, unsigned char hi) {
+    int c;
+
+    if(!isgraph(lo) || !isgraph(hi) || hi < lo)
+        return -EINVAL;
+
+    for(c = lo; c <= hi; ++c)
+        in_set[c] = true;
+
+    return 0;
+}
+
+/* Compiles a code format. Each position is one of:
+   a, A, 0     a lower case letter, an upper case letter or a digit
+   [...]       a character of the set, with ranges like [a-fx0-9] and \ to escape ] or -
+   \c          the character c itself
+   c           any other character except ] { }, itself
+followed by {n} to repeat it n times */
+static int compile_format(const char *fmt, struct code_pattern *pat) {
+    bool in_set[256];
+    unsigned char set[256];
+    unsigned char lo, hi;
+    unsigned int count;
+    const char *end;
+    int c, size, offset, r = 0;
+
+    pat->length = 0;
+    pat->pool_len = 0;
+
+    while(*fmt) {
+        memset(in_set, 0, sizeof(in_set));
+
+        if(*fmt == 'a' || *fmt == 'A')
+            r = add_range(in_set, *fmt, *fmt + 25);
+        else if(*fmt == '0')
+            r = add_range(in_set, '0', '9');
+        else if(*fmt == '[') {
+            /* Custom set, not empty */
+            if(*++fmt == ']')
+                return -EINVAL;
+
+            while(*fmt && *fmt != ']') {
+                if(*fmt == '\\' && fmt[1])
+                    fmt++;
+                lo = hi = *fmt;
+
+                if(fmt[1] == '-' && fmt[2] && fmt[2] != ']') {
+                    hi = fmt[2];
+                    fmt += 2;
+                }
+
+                if((r = add_range(in_set, lo, hi)))
+                    return r;
+                fmt++;
+            }
+
+            if(*fmt != ']')
+                return -EINVAL;
+        }
+        else if(*fmt == '\\') {
+            if(!fmt[1])
+                return -EINVAL;
+            r = add_range(in_set, fmt[1], fmt[1]);
+            fmt++;
+        }
+        else if(*fmt == ']' || *fmt == '{' || *fmt == '}')
+            return -EINVAL;
+        else
+            r = add_range(in_set, *fmt, *fmt);
+
+        if(r)
+            return r;
+        fmt++;
+
+        /* Repeat count, parsed digit by digit so it can't overflow */
+        count = 1;
+        if(*fmt == '{') {
+            count = 0;
+            for(end = fmt+1; isdigit(*end); ++end) {
+                count = count*10 + (*end - '0');
+                if(count > MAX_CODE_SIZE)
+                    return -EINVAL;
+            }
+            if(end == fmt+1 || *end != '}' || count == 0)
+                return -EINVAL;
+            fmt = end+1;
+        }
+
+        if(count > MAX_CODE_SIZE - pat->length)
+            return -EINVAL;
+
+        /* The characters of the set, in order */
+        size = 0;
+        for(c = 0; c < 256; ++c) {
+            if(in_set[c])
+                set[size++] = c;
+        }
+
+        if((offset = pool_add(pat, set, size)) < 0)
+            return offset;
+
+        while(count--) {
+            pat->pos[pat->length].offset = offset;
+            pat->pos[pat->length].size = size;
+            pat->length++;
+        }
+    }
+
+    return pat->length ? 0 : -EINVAL;
+}
+
+/* Applies a setting to a configuration */
+static int parse_config(char *kbuf, struct code_config *cfg) {
+    char aux[MAX_CHARS];
+    struct code_pattern *pat;
+    unsigned int num;
+    unsigned long long period;
+    int r;
 
     /* Parsing the operation */
-    if(sscanf(kbuf, "timer_period_ms %u", &num) == 1)
-        timer_period_ms = num;
+    /* The period can be given in ms, us or ns */
+    if(sscanf(kbuf, "timer_period_ms %llu", &period) == 1)
+        period *= NSEC_PER_MSEC;
+    else if(sscanf(kbuf, "timer_period_us %llu", &period) == 1)
+        period *= NSEC_PER_USEC;
+    else if(sscanf(kbuf, "timer_period_ns %llu", &period) != 1)
+        period = 0;
+
+    if(period) {
+        if(period < MIN_PERIOD_NS)
+            return -EINVAL;
+        cfg->timer_period_ns = period;
+    }
     else if(sscanf(kbuf, "emergency_threshold %u", &num) == 1)
-        emergency_threshold = num;
+        cfg->emergency_threshold = num;
+    else if(strncmp(kbuf, "flush_cpu reader", 16) == 0)
+        cfg->flush_cpu = FLUSH_READER;
+    else if(strncmp(kbuf, "flush_cpu unbound", 17) == 0)
+        cfg->flush_cpu = FLUSH_UNBOUND;
+    else if(sscanf(kbuf, "flush_latency_us %u", &num) == 1)
+        cfg->flush_latency_us = num;
+    else if(sscanf(kbuf, "batch_min %u", &num) == 1) {
+        if(num < 1)
+            return -EINVAL;
+        cfg->batch_min = num;
+    }
+    else if(sscanf(kbuf, "codes_per_tick %u", &num) == 1) {
+        if(num < 1 || num > MAX_CODES_PER_TICK)
+            return -EINVAL;
+        cfg->codes_per_tick = num;
+    }
+    else if(sscanf(kbuf, "seed %u", &num) == 1) {
+        /* From the next open in the defaults, right away on /proc/codetimer */
+        cfg->code_seed = num;
+        cfg->seeded = 1;
+    }
+    else if(strncmp(kbuf, "seed random", 11) == 0)
+        cfg->seeded = 0;
     else if(sscanf(kbuf, "code_format %s", aux) == 1) {
-    	if(strlen(aux) > MAX_CODE_SIZE)
+    	if(strlen(aux) > MAX_FORMAT)
     		return -EINVAL;
-        for(i = 0; i < strlen(aux); ++i){
-            if(aux[i] != 'a' && aux[i] != 'A' && aux[i] != '0')
-                return -EINVAL;
+
+        /* Compiled apart, the configuration only changes if it's right */
+        if(!(pat = kmalloc(sizeof(struct code_pattern), GFP_KERNEL)))
+            return -ENOMEM;
+
+        r = compile_format(aux, pat);
+        /* The staging buffer needs room for a whole code */
+        if(!r && pat->length+1 > cbuf_size)
+            r = -EINVAL;
+
+        if(!r) {
+            strcpy(cfg->code_format, aux);
+            cfg->pattern = *pat;
         }
-        
-        strcpy(code_format, aux);
+        kfree(pat);
+
+        if(r)
+            return r;
     }
     else
         return -EINVAL;
+
+    return 0;
+}
+
+static ssize_t configproc_write(struct file *file, const char *buff, size_t len, loff_t *off) {
+    /* Private copy of the data in kernel space */
+    char kbuf[MAX_CHARS];
+    int r;
+
+    if(len >= MAX_CHARS)
+        return -ENOSPC;
+
+    /* Transfer user data to kernel space */
+    if(copy_from_user(kbuf, buff, len))
+        return -EFAULT;
+
+    kbuf[len] = '\0';
+
+    /* Changes the settings of the sessions opened from now on */
+    if(down_interruptible(&sem_config))
+        return -EINTR;
+
+    r = parse_config(kbuf, &defaults);
+
+    up(&sem_config);
+
+    if(r)
+        return r;
     
     *off += len;
 
@@ -385,6 +1139,56 @@ static ssize_t configproc_write(struct file *file, const char *buff, size_t len,
     return len;
 }
 
+/* Writing to /proc/codetimer changes the settings of that session only,
+with the same syntax as /proc/codeconfig */
+static ssize_t timerproc_write(struct file *file, const char *buff, size_t len, loff_t *off) {
+    struct session *ses = file->private_data;
+    struct code_config *cfg;
+    char kbuf[MAX_CHARS];
+    int r, reseed;
+
+    if(len >= MAX_CHARS)
+        return -ENOSPC;
+
+    if(copy_from_user(kbuf, buff, len))
+        return -EFAULT;
+
+    kbuf[len] = '\0';
+
+    if(!(cfg = kmalloc(sizeof(struct code_config), GFP_KERNEL)))
+        return -ENOMEM;
+
+    if(down_interruptible(&sem_config)) {
+        kfree(cfg);
+        return -EINTR;
+    }
+
+    /* Changed on a copy, and the timer of the session is stopped while it's replaced,
+    so it never generates codes from half of the old settings and half of the new ones */
+    *cfg = ses->cfg;
+    if(!(r = parse_config(kbuf, cfg))) {
+        hrtimer_cancel(&ses->my_timer);
+        reseed = cfg->seeded != ses->cfg.seeded || cfg->code_seed != ses->cfg.code_seed;
+        ses->cfg = *cfg;
+        /* A new seed restarts the sequence of the session from it */
+        if(reseed)
+            seed_generator(ses);
+        hrtimer_start(&ses->my_timer, ns_to_ktime(ses->cfg.timer_period_ns), HRTIMER_MODE_REL);
+    }
+
+    up(&sem_config);
+    kfree(cfg);
+
+    if(r)
+        return r;
+
+    *off += len;
+
+    printk(KERN_INFO "codetimer: Write.\n");
+
+    return len;
+}
+
 
 
 /* /proc/codetimer file operations */
@@ -392,6 +1196,7 @@ static const struct file_operations proc_timer_fops = {
     .open = timerproc_open,
     .release = timerproc_release,
     .read = timerproc_read,
+    .write = timerproc_write,
 };
 
 /* /proc/codeconfig file operations */
@@ -404,39 +1209,87 @@ static const struct file_operations proc_config_fops = {
 
 
 
+/* Destroys the kthread workers of MODE_KWORKER */
+static void destroy_workers(void) {
+    struct kthread_worker *worker;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        if ((worker = per_cpu(flush_worker, cpu))) {
+            kthread_destroy_worker(worker);
+            per_cpu(flush_worker, cpu) = NULL;
+        }
+    }
+}
+
+/* A kthread worker on every online CPU for MODE_KWORKER */
+static int create_workers(void) {
+    struct kthread_worker *worker;
+    int cpu;
+
+    for_each_online_cpu(cpu) {
+        worker = kthread_create_worker_on_cpu(cpu, 0, "codetimer/%d", cpu);
+        if (IS_ERR(worker)) {
+            destroy_workers();
+            return PTR_ERR(worker);
+        }
+        flusher_priority(worker->task);
+        per_cpu(flush_worker, cpu) = worker;
+    }
+
+    return 0;
+}
+
 int init_codetimer_module( void ) {
-    int retval;
+    int r;
 
-    /* Initialize the list */
-    INIT_LIST_HEAD(&mylist);
+    /* Initializing the semaphore of the settings to 1 */
+    sema_init(&sem_config, 1);
 
-    /* Circular buffer initialization */
-    if ((retval = kfifo_alloc(&cbuffer,CBUF_SIZE,GFP_KERNEL)))
-        return -ENOMEM;
+    /* Compiles the default format, the staging buffer needs room for a whole code */
+    if (compile_format(defaults.code_format, &defaults.pattern)
+            || cbuf_size < defaults.pattern.length+1)
+        return -EINVAL;
 
-    /* Initializing the waiting queue semaphore to 0 */
-    sema_init(&queue, 0);
-    waiting = 0;
+    for (flush_kind = 0; flush_kind < ARRAY_SIZE(mode_names); ++flush_kind) {
+        if (strcmp(flush_mode, mode_names[flush_kind]) == 0)
+            break;
+    }
+    if (flush_kind == ARRAY_SIZE(mode_names))
+        return -EINVAL;
 
-    /* Initializing the semaphore that allows mutual exclusion of the linked list to 1 */
-    sema_init(&sem_list, 1);
+    if (flush_kind == MODE_KWORKER && (r = create_workers()))
+        return r;
+
+    /* Create a private workqueue named 'my_queue', and the unbound one, shared by all the sessions */
+    my_wq = create_workqueue("my_queue");
+    unbound_wq = alloc_workqueue("codetimer_flush", WQ_UNBOUND | WQ_HIGHPRI, 0);
+
+    if (!my_wq || !unbound_wq) {
+        if (my_wq)
+            destroy_workqueue(my_wq);
+        if (unbound_wq)
+            destroy_workqueue(unbound_wq);
+        destroy_workers();
+        return -ENOMEM;
+    }
 
     proc_timer_entry = proc_create_data("codetimer",0666, NULL, &proc_timer_fops, NULL);
     proc_config_entry = proc_create_data("codeconfig",0666, NULL, &proc_config_fops, NULL);
 
-    if (proc_timer_entry == NULL) {
-        kfifo_free(&cbuffer);
+    if (proc_timer_entry == NULL || proc_config_entry == NULL) {
+        if (proc_timer_entry)
+            remove_proc_entry("codetimer", NULL);
+        if (proc_config_entry)
+            remove_proc_entry("codeconfig", NULL);
+        destroy_workqueue(my_wq);
+        destroy_workqueue(unbound_wq);
+        destroy_workers();
         printk(KERN_INFO "codetimer: Coudn't create the entry in /proc.\n");
         return  -ENOMEM;
     }
 
-    if (proc_config_entry == NULL) {
-        kfifo_free(&cbuffer);
-        printk(KERN_INFO "codeconfig: Coudn't create the entry in /proc.\n");
-        return  -ENOMEM;
-    }
-
-    printk(KERN_INFO "codetimer: Module loaded.\n");
+    printk(KERN_INFO "codetimer: Module loaded, flush_mode %s.\n", mode_names[flush_kind]);
     printk(KERN_INFO "codeconfig: Module loaded.\n");
 
     return 0;
@@ -444,16 +1297,15 @@ int init_codetimer_module( void ) {
 
 
 void cleanup_codetimer_module( void ) {
-	/* Frees the circular buffer */
-    kfifo_free(&cbuffer);
-    
-    /* Delete elements of the linked list */
-    cleanup();
-
     /* Remove /proc file entrys */
     remove_proc_entry("codetimer", NULL);
     remove_proc_entry("codeconfig", NULL);
 
+    /* Every session has already been released */
+    destroy_workqueue(my_wq);
+    destroy_workqueue(unbound_wq);
+    destroy_workers();
+
     printk(KERN_INFO "codetimer: Module unloaded.\n");
     printk(KERN_INFO "codeconfig: Module unloaded.\n");
 
@@ -8,10 +8,14 @@
 #include <linux/random.h>
 #include <linux/string.h>
 #include <linux/uaccess.h>
-#include <linux/kfifo.h>
 #include <linux/workqueue.h>
 #include <linux/slab.h>
-#include <linux/vmalloc.h> 
+#include <linux/atomic.h>
+#include <linux/llist.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/jhash.h>
+#include <linux/ctype.h>
 
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("codetimer Module - Arquitectura de Linux y Android");
@@ -24,34 +28,58 @@ MODULE_AUTHOR("d-Raco, joseignaciodg");
 #define NUM_OF_LETTERS 26
 #define NUM_OF_DIGITS 10
 #define NUM_OF_CPU 2
+#define MAX_QUEUES 16
+
+/* How codes are routed to the queues */
+#define ROUTE_LENGTH 0 /* Length modulo the number of queues */
+#define ROUTE_HASH 1 /* Hash of the code, to balance the load */
+#define ROUTE_CLASS 2 /* Hash of the character classes, codes with the same shape go together */
 
 /* /proc entrys */
 static struct proc_dir_entry *proc_timer_entry;
 static struct proc_dir_entry *proc_config_entry;
 
-struct kfifo cbuffer; /* Circular buffer */
-struct list_head mylistEven; /* Even linked list */
-struct list_head mylistOdd; /* Odd linked list */
+/* The work adds codes to these lock-free lists and readers take all of them at once,
+so neither of them ever waits for the other. There's one per queue */
+struct llist_head mylist[MAX_QUEUES];
 
 /* List nodes */
 struct list_item {
 	unsigned char data[MAX_CODE_SIZE+1];
-	struct list_head links;
+	struct llist_node links;
+};
+
+/* Staging buffers. The timer adds codes to the active one while the work empties the other,
+so they never need a lock: the work swaps them and waits for the timer to leave the old one */
+struct staging {
+	unsigned char data[CBUF_SIZE];
+	unsigned int len;
+	atomic_t writing; /* The timer is adding a code to this buffer */
+};
+
+struct staging cbuffer[2];
+atomic_t active = ATOMIC_INIT(0); /* Buffer the timer adds codes to */
+/* Codes that didn't fit in the active buffer, already in list nodes, newest first */
+LLIST_HEAD(overflow);
+
+/* Private data of each open file */
+struct reader {
+	unsigned int queue; /* Queue it reads */
+	struct llist_node *pending; /* Codes taken from the list but not yet read, oldest first */
 };
 
 unsigned int timer_period_ms = 1000; /* Measures the time (ms) of the code generation */
 unsigned int emergency_threshold = 75; /* At which percentage of buffer size the data is going to be transferred to the workqueue */
 
-unsigned int even = 0; /* Used for knowing when the proc even entry is ready */
-unsigned int odd = 0; /* Used for knowing when the proc odd entry is ready */
+unsigned int nr_queues = 2; /* Queues the codes are routed to */
+int route_mode = ROUTE_LENGTH; /* With 2 queues, even-length codes go to the first one and odd-length ones to the second */
+unsigned int readers[MAX_QUEUES]; /* Readers of each queue, codes for a queue without readers are discarded */
+unsigned int nr_readers = 0;
+int generating = 0; /* The timer is active */
 
-DEFINE_SPINLOCK(buffer_lock); /* Spinlock for the circular buffer */
-struct semaphore sem_list_even;  /* Mutex for the even linked list */
-struct semaphore sem_list_odd;  /* Mutex for the odd linked list */
-struct semaphore queue_even;  /* Waiting queue when even linked list is empty */
-struct semaphore queue_odd;  /* Waiting queue when odd linked list is empty */
-int waiting_even; /* Number of processes waiting the even list */
-int waiting_odd; /* Number of processes waiting the odd list */
+wait_queue_head_t queue_wait[MAX_QUEUES];  /* Waiting queues when the linked lists are empty */
+wait_queue_head_t open_wait;  /* Readers wait here until every queue has one */
+struct semaphore sem_readers; /* Protects readers, nr_readers and generating across opens and releases */
 
 struct work_struct my_work; /* Work descriptor */
 
@@ -62,65 +90,88 @@ int jobFinished = 1;
 
 
 
-static void copy_items_into_list(struct work_struct *work) {
-	unsigned long flags;
-	unsigned char buffer[CBUF_SIZE], code[MAX_CODE_SIZE+1];
-	int nr_bytes, i, j = 0, r;
-	struct list_item *node;
-	
-	spin_lock_irqsave(&buffer_lock, flags);
+/* Chooses the queue of a code */
+static unsigned int route_code(const unsigned char *code, int length) {
+	u32 shape = 0;
+	int i;
 
-	/* Critical section where the buffer is accessed in porcess context */
-	nr_bytes = kfifo_out(&cbuffer, buffer, kfifo_len(&cbuffer));
-	
-	spin_unlock_irqrestore(&buffer_lock, flags);
+	if(route_mode == ROUTE_HASH)
+		return jhash(code, length, 0) % nr_queues;
 
-	while(j < nr_bytes && j < CBUF_SIZE) {
-		i = 0;
+	if(route_mode == ROUTE_CLASS) {
+		/* Two bits per character: upper case, lower case or digit */
+		for(i = 0; i < length; ++i)
+			shape = (shape << 2) | (isupper(code[i]) ? 1 : islower(code[i]) ? 2 : 3);
 
-		while(buffer[j] != '\0'  && j < CBUF_SIZE) {
-			code[i++] = buffer[j++];
-		}
-		code[i] = '\0';
-		j++;
+		return jhash_1word(shape, 0) % nr_queues;
+	}
 
-		node = vmalloc(sizeof(struct list_item));
-		strcpy(node->data, code);
+	return length % nr_queues;
+}
 
-		if(i % 2 == 0 && even) {
-			/* "Acquires" the mutex */
-			r = down_interruptible(&sem_list_even);
 
-			/* Adds the node at the end of the list */
-			list_add_tail(&node->links, &mylistEven);
+/* Adds a node to the list of its queue, readers put the codes back in order */
+static void add_to_list(struct list_item *node) {
+	unsigned int q = route_code(node->data, strlen(node->data));
 
-			/* "Frees" the mutex */
-			up(&sem_list_even);
+	/* Codes without a reader are discarded */
+	if(!readers[q]) {
+		kfree(node);
+		return;
+	}
 
-			printk(KERN_INFO "codetimer: Copied to even list -> %s\n", code);
-		}
-		else if(i % 2 != 0 && odd) {
-			/* "Acquires" the mutex */
-			r = down_interruptible(&sem_list_odd);
+	llist_add(&node->links, &mylist[q]);
+
+	printk(KERN_INFO "codetimer: Copied to list %u -> %s\n", q, node->data);
+}
+
+/* Gives the timer the other staging buffer and returns the one it was using,
+once the timer is done with it */
+static struct staging *swap_staging(void) {
+	int old = atomic_read(&active);
+	struct staging *st = &cbuffer[old];
+
+	/* Only the work swaps them. Full barrier: from now on the timer either sees
+	the new buffer or has already raised writing in the old one */
+	atomic_xchg(&active, !old);
+
+	while(atomic_read(&st->writing))
+		cpu_relax();
 
-			/* Adds the node at the end of the list */
-			list_add_tail(&node->links, &mylistOdd);
+	/* Its codes are visible after the flag */
+	smp_rmb();
 
-			/* "Frees" the mutex */
-			up(&sem_list_odd);
-			
-			printk(KERN_INFO "codetimer: Copied to odd list -> %s\n", code);
+	return st;
+}
+
+static void copy_items_into_list(struct work_struct *work) {
+	struct staging *st = swap_staging();
+	struct llist_node *first;
+	struct list_item *node, *aux;
+	unsigned int q;
+	int len, j = 0;
+
+	/* The timer is adding codes to the other buffer, this one is only ours */
+	while(j < st->len) {
+		len = strlen(st->data + j);
+
+		if((node = kmalloc(sizeof(struct list_item), GFP_KERNEL))) {
+			strcpy(node->data, st->data + j);
+			add_to_list(node);
 		}
-	}
 
-	if(waiting_even > 0){
-		waiting_even--;
-		up(&queue_even);
+		j += len+1;
 	}
+	st->len = 0;
+
+	/* Then the codes that didn't fit, oldest first */
+	first = llist_reverse_order(llist_del_all(&overflow));
+	llist_for_each_entry_safe(node, aux, first, links)
+		add_to_list(node);
 
-	if(waiting_odd > 0){
-		waiting_odd--;
-		up(&queue_odd);
+	for(q = 0; q < nr_queues; ++q) {
+		if(!llist_empty(&mylist[q]))
+			wake_up_interruptible(&queue_wait[q]);
 	}
 
 	printk(KERN_INFO "codetimer: Copied items to the list.\n");
@@ -129,6 +180,24 @@ static void copy_items_into_list(struct work_struct *work) {
 }
 
 
+/* Takes the active staging buffer. Raising writing before checking it's still active
+pairs with the swap, so the work never empties a buffer the timer is adding to */
+static struct staging *enter_staging(void) {
+	struct staging *st;
+
+	for(;;) {
+		st = &cbuffer[atomic_read(&active)];
+		atomic_set(&st->writing, 1);
+		smp_mb();
+
+		if(st == &cbuffer[atomic_read(&active)])
+			return st;
+
+		/* Swapped meanwhile */
+		atomic_set(&st->writing, 0);
+	}
+}
+
 /* Function invoked when timer expires (fires) */
 static void fire_timer(unsigned long data) {
 	unsigned int random;
@@ -136,6 +205,9 @@ static void fire_timer(unsigned long data) {
 	unsigned char code[MAX_CODE_SIZE+1];
 	int code_length;
 	int i = 0, cpu, cpu_actual = smp_processor_id(), op;
+	struct staging *st;
+	struct list_item *node;
+	unsigned int queued;
 
 	/* Generates a random number of 32 bits */ 
 	random = get_random_int();
@@ -176,16 +248,25 @@ static void fire_timer(unsigned long data) {
 	}
 	code[code_length] = '\0';
 
-	/* Acquire the spin lock */
-	spin_lock(&buffer_lock);
+	st = enter_staging();
 
-	kfifo_in(&cbuffer, code, code_length+1);
+	if(st->len + code_length+1 <= CBUF_SIZE) {
+		memcpy(st->data + st->len, code, code_length+1);
+		st->len += code_length+1;
+	}
+	/* A full buffer doesn't lose the code, it goes to the overflow chain */
+	else if((node = kmalloc(sizeof(struct list_item), GFP_ATOMIC))) {
+		strcpy(node->data, code);
+		llist_add(&node->links, &overflow);
+	}
+	queued = st->len;
 
-	/* Free the spin lock */
-	spin_unlock(&buffer_lock);
+	/* Leaves the buffer, the code is written before the flag drops */
+	smp_wmb();
+	atomic_set(&st->writing, 0);
 
 	/* If the buffer fills up to the emergency threshold, transfer the codes to the linked list */
-	if(((CBUF_SIZE * emergency_threshold) / 100) <= (kfifo_len(&cbuffer)) && jobFinished) {
+	if((((CBUF_SIZE * emergency_threshold) / 100) <= queued || !llist_empty(&overflow)) && jobFinished) {
 		cpu = cpu_actual + 1;
 		if(cpu >= NUM_OF_CPU)
 			cpu = 0;
@@ -208,92 +289,130 @@ static void fire_timer(unsigned long data) {
 
 
 
+/* Frees a chain of nodes */
+static void free_nodes(struct llist_node *first) {
+	/* Variables needed for the for loop */
+	struct list_item *freeNode = NULL, *aux = NULL;
+
+	llist_for_each_entry_safe(freeNode, aux, first, links)
+		kfree(freeNode);
+}
+
 /* Empties the list */
-void cleanup(unsigned int oddL){
-	int r;
+void cleanup(unsigned int q){
+	/* Takes every node out of the list at once and frees them */
+	free_nodes(llist_del_all(&mylist[q]));
+
+	printk(KERN_INFO "codetimer: Cleaned the whole list %u.\n", q);
+}
 
-	/* Variables needed for the for loop */
-	struct list_head *aux = NULL, *pos = NULL;
-	/* Node to be freed */
-	struct list_item *freeNode = NULL;
-
-	if(oddL) {
-		/* "Acquires" the mutex */
-		r = down_interruptible(&sem_list_odd);
-		
-		/* Delete all nodes from the list and frees space */
-		list_for_each_safe(pos, aux, &mylistOdd){
-			freeNode = list_entry(pos, struct list_item, links);
-			list_del(pos);
-			vfree(freeNode);
-		}
 
-		/* "Frees" the mutex */
-	  	up(&sem_list_odd);
 
-		printk(KERN_INFO "codetimer: Cleaned the whole odd list.\n");
-	}
-	else {
-		/* "Acquires" the mutex */
-		r = down_interruptible(&sem_list_even);
-		
-		/* Delete all nodes from the list and frees space */
-		list_for_each_safe(pos, aux, &mylistEven){
-			freeNode = list_entry(pos, struct list_item, links);
-			list_del(pos);
-			vfree(freeNode);
-		}
 
-		/* "Frees" the mutex */
-	  	up(&sem_list_even);
 
-		printk(KERN_INFO "codetimer: Cleaned the whole even list.\n");
-	}
-}
 
 
+/* Every queue has a reader. Must be called with sem_readers held */
+static int all_queues_read(void) {
+	unsigned int q;
 
+	for(q = 0; q < nr_queues; ++q) {
+		if(!readers[q])
+			return 0;
+	}
 
+	return 1;
+}
 
+/* Unbinds a reader from its queue, stopping the generation when the queue is left
+without readers. Must be called with sem_readers held */
+static void drop_reader(struct reader *rd) {
+    readers[rd->queue]--;
+    nr_readers--;
+
+    /* Generation goes on while every queue still has a reader */
+    if(readers[rd->queue] == 0) {
+		/* Wait until completion of the timer function (if it's currently running) and delete timer */
+	  	if(generating) {
+	  		del_timer_sync(&my_timer);
+	  		generating = 0;
+	  	}
 
+		/* Wait until all jobs scheduled so far have finished */
+		flush_scheduled_work();
+
+	  	/* Delete elements of the staging buffers */
+	    cbuffer[0].len = cbuffer[1].len = 0;
+	    free_nodes(llist_del_all(&overflow));
+
+	    /* Delete elements of the linked list */
+	    cleanup(rd->queue);
+    }
+}
 
 static int timerproc_open(struct inode *i, struct file *file) {
+	struct reader *rd;
+	unsigned int q;
+
 	/* Increment the Reference Counter of the module */
 	try_module_get(THIS_MODULE);
 
-    file->private_data = vmalloc(sizeof(unsigned int));
-    *((unsigned int*)file->private_data) = even;
+    if(!(rd = kzalloc(sizeof(struct reader), GFP_KERNEL))) {
+        module_put(THIS_MODULE);
+        return -ENOMEM;
+    }
+
+    if(down_interruptible(&sem_readers)) {
+        kfree(rd);
+        module_put(THIS_MODULE);
+        return -EINTR;
+    }
 
-    if(even == 0)
-    	even++;
-    else
-    	odd++;
+    /* Binds to the queue with fewer readers */
+    rd->queue = 0;
+    for(q = 1; q < nr_queues; ++q) {
+    	if(readers[q] < readers[rd->queue])
+    		rd->queue = q;
+    }
+    file->private_data = rd;
 
-	/* Initialize work structure (with function) */
-	INIT_WORK(&my_work, copy_items_into_list);
+    readers[rd->queue]++;
+    nr_readers++;
 
-	/* Create timer */
-    init_timer(&my_timer);
+    /* Generation starts once every queue has a reader */
+    if(all_queues_read() && !generating) {
+		/* Initialize work structure (with function) */
+		INIT_WORK(&my_work, copy_items_into_list);
 
-    /* Initialize field */
-    my_timer.data = 0;
-    my_timer.function = fire_timer;
-    my_timer.expires = jiffies + (HZ*timer_period_ms)/1000;  /* Activate it timer_period_ms milliseconds from now */
+		/* Create timer */
+		init_timer(&my_timer);
 
-    if(waiting_odd <= 0) {
-    	waiting_odd++;
-    	if (down_interruptible(&queue_odd)) {
-    		waiting_odd--;
-			return -EINTR;
-    	}
+		/* Initialize field */
+		my_timer.data = 0;
+		my_timer.function = fire_timer;
+		my_timer.expires = jiffies + (HZ*timer_period_ms)/1000;  /* Activate it timer_period_ms milliseconds from now */
 
-    	/* Activate the timer for the first time */
-    	add_timer(&my_timer);
+		/* Activate the timer for the first time */
+		add_timer(&my_timer);
+		generating = 1;
+
+		/* Wakes up the readers that were waiting */
+		wake_up_interruptible(&open_wait);
+    }
+
+    up(&sem_readers);
+
+    /* The others wait without holding the semaphore, so the last reader can get in.
+    Non-blocking readers don't wait, their reads fail with -EAGAIN and poll() reports
+    nothing until codes are generated */
+    if (!(file->f_flags & O_NONBLOCK) && wait_event_interruptible(open_wait, generating)) {
+    	down(&sem_readers);
+    	drop_reader(rd);
+    	up(&sem_readers);
+    	kfree(rd);
+    	module_put(THIS_MODULE);
+		return -EINTR;
     }
-    else {
-    	waiting_odd--;
-    	up(&queue_odd);
-    } 
 
     printk(KERN_INFO "codetimer: Open.\n");
 
@@ -301,24 +420,16 @@ static int timerproc_open(struct inode *i, struct file *file) {
 }
 
 static int timerproc_release(struct inode *i, struct file *file) {
-	/* Wait until completion of the timer function (if it's currently running) and delete timer */
-  	del_timer_sync(&my_timer);
+	struct reader *rd = file->private_data;
 
-	/* Wait until all jobs scheduled so far have finished */
-	flush_scheduled_work();
-
-  	/* Delete elements of the circular buffer */
-    kfifo_reset(&cbuffer);
-
-    if(*((unsigned int*)file->private_data))
-    	odd--;
-    else
-    	even--;
+	down(&sem_readers);
+	drop_reader(rd);
+	up(&sem_readers);
 
-    /* Delete elements of the linked list */
-    cleanup(*((unsigned int*)file->private_data));
+    /* And the ones taken but not read */
+    free_nodes(rd->pending);
 
-    vfree(file->private_data);
+    kfree(rd);
 
     /* Decrement the Reference Counter of the module */
 	module_put(THIS_MODULE);
@@ -329,98 +440,45 @@ static int timerproc_release(struct inode *i, struct file *file) {
 }
 
 static ssize_t timerproc_read(struct file *file, char *buff, size_t len, loff_t *off) {
+	struct reader *rd = file->private_data;
+	struct llist_head *list = &mylist[rd->queue];
+	wait_queue_head_t *queue = &queue_wait[rd->queue];
 	char kbuf[MAX_DIGS];
-    int nr_bytes = 0;
-    /* Variable needed for the loop */
-	struct list_head *pos = NULL;
+    int nr_bytes = 0, n;
 	/* Variable that will retrieve the node */
 	struct list_item *node = NULL;
-	unsigned char data[MAX_CODE_SIZE+1];
+	char data[MAX_CODE_SIZE+2];
 
-	if(*((unsigned int*)file->private_data)) {
-		/* "Acquires" the mutex */
-		if (down_interruptible(&sem_list_odd))
-			return -EINTR;
+	/* Codes left by the previous read go first. Otherwise takes the whole list at once,
+	newest first. Another reader of the queue may take it first, so it's tried again
+	after every wakeup */
+	while(!rd->pending && !(rd->pending = llist_reverse_order(llist_del_all(list)))) {
+		/* Non-blocking readers wait for poll() instead */
+		if(file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
 
 		/* Blocks until the list has been filled */
-	  	while(list_empty(&mylistOdd)) {
-	  		waiting_odd++;
-
-	  		/* "Frees" the mutex */
-	  		up(&sem_list_odd);
-
-	  		/* Blocks in the queue */
-			if (down_interruptible(&queue_odd)){
-				down(&sem_list_odd);
-				waiting_odd--;
-				up(&sem_list_odd);
-				return -EINTR;
-			}
-
-			/* "Acquires" the mutex */
-			if (down_interruptible(&sem_list_odd))
-				return -EINTR;
-	  	}
-
-	  	/* Traverse the hole list and stores the data. 
-		The data is stored by digits, and a \n when a number ends. */
-		list_for_each(pos, &mylistOdd) {
-			node = list_entry(pos, struct list_item, links);
-			strncpy(data, node->data, MAX_CODE_SIZE+1);
-
-			nr_bytes += snprintf((kbuf+nr_bytes), MAX_CODE_SIZE+2, "%s\n", data);
-		}
-
-	  	/* "Frees" the mutex */
-	  	up(&sem_list_odd);
-	  	
-	  	cleanup(*((unsigned int*)file->private_data));
-
-	  	printk(KERN_INFO "codetimer: Read the odd list.\n");
-	}
-	else {
-		/* "Acquires" the mutex */
-		if (down_interruptible(&sem_list_even))
+		if (wait_event_interruptible(*queue, !llist_empty(list)))
 			return -EINTR;
+	}
 
-		/* Blocks until the list has been filled */
-	  	while(list_empty(&mylistEven)) {
-	  		waiting_even++;
-
-	  		/* "Frees" the mutex */
-	  		up(&sem_list_even);
-
-	  		/* Blocks in the queue */
-			if (down_interruptible(&queue_even)){
-				down(&sem_list_even);
-				waiting_even--;
-				up(&sem_list_even);
-				return -EINTR;
-			}
-
-			/* "Acquires" the mutex */
-			if (down_interruptible(&sem_list_even))
-				return -EINTR;
-	  	}
-
-	  	/* Traverse the hole list and stores the data. 
-		The data is stored by digits, and a \n when a number ends. */
-		list_for_each(pos, &mylistEven) {
-			node = list_entry(pos, struct list_item, links);
-			strncpy(data, node->data, MAX_CODE_SIZE+1);
+  	/* Stores the codes that fit, freeing their nodes, and keeps the rest for the next read.
+	The data is stored by digits, and a \n when a number ends. */
+	while(rd->pending) {
+		node = llist_entry(rd->pending, struct list_item, links);
+		n = snprintf(data, MAX_CODE_SIZE+2, "%s\n", node->data);
 
-			nr_bytes += snprintf((kbuf+nr_bytes), MAX_CODE_SIZE+2, "%s\n", data);
-		}
+		if(nr_bytes + n > len || nr_bytes + n > MAX_DIGS)
+			break;
 
-	  	/* "Frees" the mutex */
-	  	up(&sem_list_even);
-	  	
-	  	cleanup(*((unsigned int*)file->private_data));
+		memcpy(kbuf+nr_bytes, data, n);
+		nr_bytes += n;
 
-	  	printk(KERN_INFO "codetimer: Read the even list.\n");
-	} 	
+		rd->pending = rd->pending->next;
+		kfree(node);
+	}
 
-    if(len < nr_bytes)
+    if(nr_bytes == 0)
         return -ENOSPC;
 
     if(copy_to_user(buff, kbuf, nr_bytes))
@@ -428,9 +486,26 @@ static ssize_t timerproc_read(struct file *file, char *buff, size_t len, loff_t
     
     *off += nr_bytes; 
 
+	printk(KERN_INFO "codetimer: Read the list %u.\n", rd->queue);
+
     return nr_bytes;
 }
 
+/* Readable while there are codes for the queue of the reader, the work wakes it up */
+static unsigned int timerproc_poll(struct file *file, poll_table *wait) {
+	struct reader *rd = file->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &queue_wait[rd->queue], wait);
+
+	if(rd->pending || !llist_empty(&mylist[rd->queue]))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
+static const char *route_names[] = { "length", "hash", "class" };
+
 static ssize_t configproc_read(struct file *file, char *buff, size_t len, loff_t *off) {
     char kbuf[MAX_DIGS];
     int nr_bytes = 0;
@@ -439,8 +514,10 @@ static ssize_t configproc_read(struct file *file, char *buff, size_t len, loff_t
     if ((*off) > 0) 
       return 0;
 
-    nr_bytes += snprintf((kbuf+nr_bytes), MAX_DIGS, "timer_period_ms = %u\n", timer_period_ms);
-    nr_bytes += snprintf((kbuf+nr_bytes), MAX_DIGS, "emergency_threshold = %u\n", emergency_threshold);
+    nr_bytes += snprintf((kbuf+nr_bytes), MAX_DIGS-nr_bytes, "timer_period_ms = %u\n", timer_period_ms);
+    nr_bytes += snprintf((kbuf+nr_bytes), MAX_DIGS-nr_bytes, "emergency_threshold = %u\n", emergency_threshold);
+    nr_bytes += snprintf((kbuf+nr_bytes), MAX_DIGS-nr_bytes, "queues = %u\n", nr_queues);
+    nr_bytes += snprintf((kbuf+nr_bytes), MAX_DIGS-nr_bytes, "route = %s\n", route_names[route_mode]);
 
     if(len < nr_bytes)
         return -ENOSPC;
@@ -458,7 +535,9 @@ static ssize_t configproc_read(struct file *file, char *buff, size_t len, loff_t
 static ssize_t configproc_write(struct file *file, const char *buff, size_t len, loff_t *off) {
     /* Private copy of the data in kernel space */
     char kbuf[MAX_CHARS];
+    char aux[MAX_CHARS];
     unsigned int num;
+    int i;
 
     if(len > MAX_CHARS)
         return -ENOSPC;
@@ -474,6 +553,28 @@ static ssize_t configproc_write(struct file *file, const char *buff, size_t len,
         timer_period_ms = num;
     else if(sscanf(kbuf, "emergency_threshold %u", &num) == 1)
         emergency_threshold = num;
+    else if(sscanf(kbuf, "queues %u", &num) == 1) {
+        if(num < 1 || num > MAX_QUEUES)
+            return -EINVAL;
+        if(down_interruptible(&sem_readers))
+            return -EINTR;
+        /* Readers are bound to a queue */
+        if(nr_readers > 0) {
+            up(&sem_readers);
+            return -EBUSY;
+        }
+        nr_queues = num;
+        up(&sem_readers);
+    }
+    else if(sscanf(kbuf, "route %s", aux) == 1) {
+        for(i = 0; i < ARRAY_SIZE(route_names); ++i) {
+            if(strcmp(aux, route_names[i]) == 0)
+                break;
+        }
+        if(i == ARRAY_SIZE(route_names))
+            return -EINVAL;
+        route_mode = i;
+    }
     else
         return -EINVAL;
     
@@ -491,6 +592,7 @@ static const struct file_operations proc_timer_fops = {
     .open = timerproc_open,
     .release = timerproc_release,
     .read = timerproc_read,
+    .poll = timerproc_poll,
 };
 
 /* /proc/codeconfig file operations */
@@ -504,37 +606,30 @@ static const struct file_operations proc_config_fops = {
 
 
 int init_codetimer_module( void ) {
-    int retval;
+    int q;
 
     /* Initialize the lists */
-    INIT_LIST_HEAD(&mylistOdd);
-    INIT_LIST_HEAD(&mylistEven);
-
-    /* Circular buffer initialization */
-    if ((retval = kfifo_alloc(&cbuffer,CBUF_SIZE,GFP_KERNEL)))
-        return -ENOMEM;
+    for(q = 0; q < MAX_QUEUES; ++q) {
+        init_llist_head(&mylist[q]);
+        init_waitqueue_head(&queue_wait[q]);
+    }
 
-    /* Initializing the waiting queue semaphore to 0 */
-    sema_init(&queue_even, 0);
-    sema_init(&queue_odd, 0);
-    waiting_even = 0;
-    waiting_odd = 0;
+    /* Readers wait for the others here */
+    init_waitqueue_head(&open_wait);
 
-    /* Initializing the semaphore that allows mutual exclusion of the linked list to 1 */
-    sema_init(&sem_list_even, 1);
-    sema_init(&sem_list_odd, 1);
+    /* Initializing the semaphore of the readers to 1 */
+    sema_init(&sem_readers, 1);
 
     proc_timer_entry = proc_create_data("codetimer",0666, NULL, &proc_timer_fops, NULL);
     proc_config_entry = proc_create_data("codeconfig",0666, NULL, &proc_config_fops, NULL);
 
     if (proc_timer_entry == NULL) {
-        kfifo_free(&cbuffer);
         printk(KERN_INFO "codetimer: Coudn't create the entry in /proc.\n");
         return  -ENOMEM;
     }
 
     if (proc_config_entry == NULL) {
-        kfifo_free(&cbuffer);
+        remove_proc_entry("codetimer", NULL);
         printk(KERN_INFO "codeconfig: Coudn't create the entry in /proc.\n");
         return  -ENOMEM;
     }
@@ -547,12 +642,14 @@ int init_codetimer_module( void ) {
 
 
 void cleanup_codetimer_module( void ) {
-	/* Frees the circular buffer */
-    kfifo_free(&cbuffer);
+    int q;
+
+	/* Frees the codes that didn't fit in the staging buffers */
+    free_nodes(llist_del_all(&overflow));
     
-    /* Delete elements of both the linked lists */
-    cleanup(0);
-    cleanup(1);
+    /* Delete elements of all the linked lists */
+    for(q = 0; q < MAX_QUEUES; ++q)
+        cleanup(q);
 
     /* Remove /proc file entrys */
     remove_proc_entry("codetimer", NULL);
@@ -8,6 +8,24 @@
 #include <asm-generic/errno.h>
 #include <linux/semaphore.h>
 #include <linux/kfifo.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/hashtable.h>
+#include <linux/stringhash.h>
+#include <linux/workqueue.h>
+#include <linux/seq_file.h>
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/ctype.h>
+
+#include "multipc.h"
 
 
 MODULE_LICENSE("GPL");
@@ -16,352 +34,2035 @@ MODULE_AUTHOR("d-Raco");
 
 #define MAX_CHARS_KBUF	20
 #define MAX_CHARS_ADMIN 20
+#define MAX_CHARS_CMD	64
+#define MAX_CHARS_KEY	10
+#define MAX_CHARS_ITEM	(64*1024) /* Largest item of 's' entries */
+#define CHECKPOINT_MAGIC 0x3243504d /* "MPC2" */
+#define AGG_BUCKETS	8
+#define PROCS_HASH_BITS	15
+#define MIGRATE_AFTER	64 /* Items consumed in a row from another node before the buffers follow */
 
 /* Params */
-static int max_entries = 5;
+static int max_entries = 100000;
 static unsigned int entries = 0;
 static int max_size = 32;
+static unsigned int idle_ms = 5000;
+static char *restore_file = NULL;
 
 module_param(max_entries, int, 0644);
 MODULE_PARM_DESC(max_entries, "An unsigned integer");
 module_param(max_size, int, 0644);
 MODULE_PARM_DESC(max_size, "An unsigned integer");
+module_param(idle_ms, uint, 0644);
+MODULE_PARM_DESC(idle_ms, "Empty buffers unused for this long are freed (0 keeps them)");
+module_param(restore_file, charp, 0444);
+MODULE_PARM_DESC(restore_file, "Checkpoint read from /proc/multipc/checkpoint to restore at load time");
+
+/* Items of 'k' entries: a newer item with the same key replaces the queued one */
+struct keyed_item {
+	char key[MAX_CHARS_KEY];
+	char *val;
+	unsigned long stamp; /* jiffies when the value was produced */
+	struct list_head links;
+};
+
+/* Items of 's' entries are kept in a chain of chunks of at most a page,
+so large items don't need contiguous memory */
+struct chunk {
+	struct chunk *next;
+	size_t len; /* Bytes used in data */
+	char data[];
+};
 
+#define CHUNK_DATA	(PAGE_SIZE - sizeof(struct chunk))
+
+/* Each slot of the circular buffer */
 typedef struct {
+	union {
+		int val; /* 'i' entries */
+		struct chunk *str; /* 's' entries */
+		struct keyed_item *kv; /* 'k' entries */
+	};
+	unsigned long stamp; /* jiffies when it was produced */
+} item_t;
+
+/* Sub-queue of one producer (process) of an entry in fair mode */
+struct producer {
+	pid_t pid;
+	unsigned int weight; /* Items consumed from this producer on each round-robin turn */
+	unsigned int credit; /* Items left in the current turn */
+	struct kfifo cbuf;
+	struct list_head links;
+};
+
+/* Running aggregates of the values produced during part of a window */
+struct agg_bucket {
+	s64 sum;
+	unsigned int count;
+	int min, max;
+};
+
+/* 'a' entries keep no items, only the aggregates of the values of a time window.
+Sliding windows are split in AGG_BUCKETS buckets that are reused as time goes by */
+struct aggregate {
+	unsigned int window_ms;
+	int sliding;
+	unsigned long start; /* jiffies when the current bucket started */
+	unsigned int cur; /* Current bucket */
+	struct agg_bucket b[AGG_BUCKETS];
+	struct agg_bucket last; /* Last complete tumbling window */
+	spinlock_t lock;
+};
+
+/* Coalesced wakeups: consumers are woken up once batch items are queued,
+or usecs after the first one that is still unpublished */
+struct wakeup {
+	unsigned int batch, usecs;
+	unsigned int pending; /* Items queued but not yet added to the elements semaphore */
+	struct hrtimer timer;
+	spinlock_t lock;
+	struct semaphore *elements;
+	struct prodcons_s *data;
+	struct work_struct kick; /* Kicks the pipeline out of the entry after the timer publishes items */
+};
+
+struct pipeline;
+
+typedef struct prodcons_s {
 	char name[MAX_CHARS_ADMIN]; /* Name of the /proc module */
-	int isInt; /* Distinguish between integer and string buffers */
+	char type; /* 'i' (integers), 's' (strings), 'k' (latest value per key) or 'a' (aggregates of integers) */
 	struct kfifo cbuf; /* Shared circular buffer */
+	struct list_head keyed; /* Queued items of 'k' entries, searched when coalescing */
+	unsigned int coalesced; /* Items of 'k' entries replaced before being consumed */
+	int fair; /* Items are kept in per-producer sub-queues consumed round-robin */
+	struct list_head producers; /* Sub-queues in fair mode */
+	struct producer *turn; /* Sub-queue being consumed */
 	struct semaphore elements, gaps; /* Producer and consumer semaphores */
+	unsigned int capacity; /* Items that fit in the buffer, max_size when the entry was created */
 	struct semaphore mtx; /* Ensures mutual exclusion while accesing the buffer */
+	unsigned int ttl_ms; /* Items older than this are discarded (0 = never) */
+	unsigned long expired; /* Items discarded because of the TTL */
+	struct aggregate *agg; /* Aggregates of 'a' entries */
+	struct wakeup *wakeup; /* Coalescing of consumer wakeups, protected by mtx */
+	struct pipeline *pipe_out, *pipe_in; /* Pipelines taking items from and into this entry */
+	spinlock_t pipe_lock; /* Protects pipe_out and pipe_in */
+	int used; /* The buffer was used since the last idle check */
+	int node; /* NUMA node for the buffers, or NUMA_NO_NODE to follow the consumer */
+	int ring_node; /* Node the buffers were allocated on */
+	unsigned int remote; /* Items consumed in a row from a node other than ring_node */
+	struct kref ref; /* Held by procDataTable and by the handles of the exported interface */
+	struct hlist_node hnode; /* Node of procDataTable */
 } prodcons;
 
 static struct proc_dir_entry *admin_entry;
 struct proc_dir_entry *multipc_dir = NULL;
-/* Linked list with all the data of the proc entries */
-struct list_head procDataList; 
-/* List nodes */
-struct list_item {
-	prodcons *data;
-	struct list_head links;
+/* Hash table with all the data of the proc entries, by name */
+static DEFINE_HASHTABLE(procDataTable, PROCS_HASH_BITS);
+/* Entries are small, so they come from their own slab cache */
+static struct kmem_cache *prodcons_cache;
+
+struct semaphore sem_list;  /* Mutex for the hash table */
+
+/* Kernel-side forwarding of the items of an entry into another one */
+struct pipeline {
+	prodcons *src, *dst;
+	char op; /* 'f' (filter), 'm' (map) or '\0' (forward everything) */
+	int a, b; /* Filter keeps a <= val <= b, map turns val into val*a + b */
+	struct work_struct work;
+};
+
+static struct workqueue_struct *pipe_wq;
+
+/* Frees the buffers of idle entries */
+static void reclaim_idle(struct work_struct *work);
+static DECLARE_DELAYED_WORK(reclaim_work, reclaim_idle);
+
+/* Item of an 's' entry being streamed to a reader across several read() calls */
+struct reader {
+	struct chunk *str;
+	size_t pos, len; /* Bytes copied and bytes to copy, including the final '\n' */
 };
 
-struct semaphore sem_list;  /* Mutex for linked list */
 
-int initializeProdcons(prodcons *data, int isInteger, char *name) {
+static void chain_free(struct chunk *c) {
+	struct chunk *next;
+
+	while (c) {
+		next = c->next;
+		kfree(c);
+		c = next;
+	}
+}
+
+/* Allocates a chain able to hold len bytes */
+static struct chunk *chain_alloc(size_t len, gfp_t gfp) {
+	struct chunk *head = NULL, **tail = &head;
+	size_t n;
+
+	do {
+		n = min(len, CHUNK_DATA);
+
+		if (!(*tail = kmalloc(sizeof(struct chunk) + n, gfp))) {
+			chain_free(head);
+			return NULL;
+		}
+		(*tail)->next = NULL;
+		(*tail)->len = n;
+
+		tail = &(*tail)->next;
+		len -= n;
+	} while (len > 0);
+
+	return head;
+}
+
+static size_t chain_len(struct chunk *c) {
+	size_t len = 0;
+
+	for (; c; c = c->next)
+		len += c->len;
+
+	return len;
+}
+
+static int chain_copy_from_user(struct chunk *c, const char __user *buf) {
+	for (; c; c = c->next) {
+		if (copy_from_user(c->data, buf, c->len))
+			return -EFAULT;
+		buf += c->len;
+	}
+
+	return 0;
+}
+
+/* Copies len bytes starting at pos */
+static int chain_copy_to_user(struct chunk *c, size_t pos, char __user *buf, size_t len) {
+	size_t n;
+
+	for (; c && len > 0; c = c->next) {
+		if (pos >= c->len) {
+			pos -= c->len;
+			continue;
+		}
+
+		n = min(len, c->len - pos);
+		if (copy_to_user(buf, c->data + pos, n))
+			return -EFAULT;
+
+		buf += n;
+		len -= n;
+		pos = 0;
+	}
+
+	return 0;
+}
+
+int initializeProdcons(prodcons *data, char type, char *name) {
 	strcpy(data->name, name);
 
-	data->isInt = isInteger;
+	data->type = type;
+	INIT_LIST_HEAD(&data->keyed);
+	data->coalesced = 0;
+	data->fair = 0;
+	INIT_LIST_HEAD(&data->producers);
+	data->turn = NULL;
+	data->ttl_ms = 0;
+	data->expired = 0;
+	data->agg = NULL;
+	data->wakeup = NULL;
+	data->pipe_out = data->pipe_in = NULL;
+	spin_lock_init(&data->pipe_lock);
+	data->node = data->ring_node = NUMA_NO_NODE;
+	data->remote = 0;
+	kref_init(&data->ref);
 
 	/* Elements semaphore, initializaed to 0 (empty buffer) */
 	sema_init(&data->elements, 0);
 
-	/* Gaps semaphore, initialized to max_size (empty buffer) */
-	sema_init(&data->gaps, max_size);
+	/* Gaps semaphore, initialized to the capacity (empty buffer) */
+	data->capacity = max_size;
+	sema_init(&data->gaps, data->capacity);
 
 	/* Semaphore for ensuring mutual exclusion */
 	sema_init(&data->mtx, 1);
 
-	/* Buffer initialization */
-	if (isInteger) {
-		if (kfifo_alloc(&data->cbuf, max_size*sizeof(int), GFP_KERNEL))
-			return 1;
-	} 
-	else {
-		if (kfifo_alloc(&data->cbuf, max_size*sizeof(char*), GFP_KERNEL))
+	/* The buffer is allocated by the first producer */
+	memset(&data->cbuf, 0, sizeof(struct kfifo));
+	data->used = 0;
+
+	return 0;
+}
+
+static void agg_reset(struct agg_bucket *b) {
+	b->sum = 0;
+	b->count = 0;
+	b->min = INT_MAX;
+	b->max = INT_MIN;
+}
+
+static void agg_merge(struct agg_bucket *dst, struct agg_bucket *src) {
+	dst->sum += src->sum;
+	dst->count += src->count;
+	dst->min = min(dst->min, src->min);
+	dst->max = max(dst->max, src->max);
+}
+
+static void agg_init(struct aggregate *ag, unsigned int window_ms, int sliding) {
+	unsigned int i;
+
+	ag->window_ms = window_ms;
+	ag->sliding = sliding;
+	ag->start = jiffies;
+	ag->cur = 0;
+
+	for (i = 0; i < AGG_BUCKETS; ++i)
+		agg_reset(&ag->b[i]);
+	agg_reset(&ag->last);
+}
+
+/* Moves the window up to now. Must be called with the lock held */
+static void agg_advance(struct aggregate *ag) {
+	unsigned long width = msecs_to_jiffies(ag->window_ms) / (ag->sliding ? AGG_BUCKETS : 1);
+	unsigned int i;
+
+	if (width == 0)
+		width = 1;
+
+	if (!ag->sliding) {
+		if (time_before(jiffies, ag->start + width))
+			return;
+
+		/* Only the window right before the current one is reported */
+		if (time_before(jiffies, ag->start + 2*width))
+			ag->last = ag->b[0];
+		else
+			agg_reset(&ag->last);
+
+		agg_reset(&ag->b[0]);
+		ag->start += ((jiffies - ag->start) / width) * width;
+		return;
+	}
+
+	/* Buckets left behind are reused for the new part of the window */
+	for (i = 0; i < AGG_BUCKETS && !time_before(jiffies, ag->start + width); ++i) {
+		ag->cur = (ag->cur + 1) % AGG_BUCKETS;
+		agg_reset(&ag->b[ag->cur]);
+		ag->start += width;
+	}
+
+	/* The whole window is older than now */
+	if (!time_before(jiffies, ag->start + width))
+		ag->start += ((jiffies - ag->start) / width) * width;
+}
+
+static void agg_add(struct aggregate *ag, int val) {
+	struct agg_bucket *b;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ag->lock, flags);
+
+	agg_advance(ag);
+
+	b = &ag->b[ag->sliding ? ag->cur : 0];
+	b->sum += val;
+	b->count++;
+	b->min = min(b->min, val);
+	b->max = max(b->max, val);
+
+	spin_unlock_irqrestore(&ag->lock, flags);
+}
+
+/* Aggregates of the sliding window, or of the last complete tumbling window */
+static void agg_get(struct aggregate *ag, struct agg_bucket *res) {
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&ag->lock, flags);
+
+	agg_advance(ag);
+
+	if (ag->sliding) {
+		agg_reset(res);
+		for (i = 0; i < AGG_BUCKETS; ++i)
+			agg_merge(res, &ag->b[i]);
+	}
+	else
+		*res = ag->last;
+
+	spin_unlock_irqrestore(&ag->lock, flags);
+}
+
+/* Frees the memory owned by an item extracted from the buffer */
+static void free_item(prodcons *data, item_t *item) {
+	if (data->type == 's')
+		chain_free(item->str);
+	else if (data->type == 'k') {
+		kfree(item->kv->val);
+		kfree(item->kv);
+	}
+}
+
+/* If there's a queued item with the same key, it takes the new value and kv is freed.
+Must be called inside the critical section */
+static int coalesce_keyed(prodcons *data, struct keyed_item *kv) {
+	struct keyed_item *pos;
+	char *old;
+
+	list_for_each_entry(pos, &data->keyed, links) {
+		if (strcmp(pos->key, kv->key) == 0) {
+			old = pos->val;
+			pos->val = kv->val;
+			pos->stamp = jiffies;
+			kfree(old);
+			kfree(kv);
+			data->coalesced++;
 			return 1;
+		}
 	}
 
 	return 0;
 }
 
-static ssize_t prodcons_write(struct file *filp, const char __user *buf, size_t len, loff_t *off) {
-	prodcons* data = (prodcons*)PDE_DATA(filp->f_inode);
-	char kbuf[MAX_CHARS_KBUF+1];
-	int val = 0;
-	char *str = NULL;
+/* Allocates a buffer for the capacity of an entry on a NUMA node. Like kfifo_alloc(), which can't choose the node */
+static int ring_alloc(prodcons *data, struct kfifo *fifo, int node, gfp_t gfp) {
+	unsigned int size = roundup_pow_of_two(data->capacity*sizeof(item_t));
+	void *buf;
 
-	/* The application can write in this entry just once !! */
-	if ((*off) > 0) 
+	if (!(buf = kmalloc_node(size, gfp, node)))
+		return -ENOMEM;
+
+	return kfifo_init(fifo, buf, size);
+}
+
+/* Node where new buffers of an entry go: the chosen one, or where the buffers already are,
+so they all stay together, or else the local one. Must be called inside the critical section */
+static int ring_node(prodcons *data) {
+	if (data->node != NUMA_NO_NODE)
+		data->ring_node = data->node;
+	else if (data->ring_node == NUMA_NO_NODE)
+		data->ring_node = numa_node_id();
+
+	return data->ring_node;
+}
+
+/* Moves the items of a buffer into a new one on another node. The old buffer is kept if there's no memory */
+static void migrate_ring(prodcons *data, struct kfifo *fifo, int node) {
+	struct kfifo moved;
+	item_t item;
+
+	if (!kfifo_initialized(fifo) || ring_alloc(data, &moved, node, GFP_KERNEL))
+		return;
+
+	while (kfifo_out(fifo, &item, sizeof(item_t)) == sizeof(item_t))
+		kfifo_in(&moved, &item, sizeof(item_t));
+
+	kfifo_free(fifo);
+	*fifo = moved;
+}
+
+/* Moves the buffer and sub-queues of an entry to a node. Must be called inside the critical section */
+static void migrate_rings(prodcons *data, int node) {
+	struct producer *p;
+
+	migrate_ring(data, &data->cbuf, node);
+
+	list_for_each_entry(p, &data->producers, links)
+		migrate_ring(data, &p->cbuf, node);
+
+	data->ring_node = node;
+	data->remote = 0;
+
+	printk(KERN_INFO "Multipc: %s moved to node %d\n", data->name, node);
+}
+
+/* Entries without a fixed node take their buffers to the node of the consumer, once it has
+been consuming from there for a while. Consumers with MULTIPC_ATOMIC only count, since the new
+buffers are allocated with GFP_KERNEL. Must be called inside the critical section */
+static void follow_consumer(prodcons *data, int flags) {
+	int node = numa_node_id();
+
+	if (data->node != NUMA_NO_NODE || data->ring_node == NUMA_NO_NODE)
+		return;
+
+	if (node == data->ring_node) {
+		data->remote = 0;
+		return;
+	}
+
+	if (++data->remote >= MIGRATE_AFTER && (flags & MULTIPC_ATOMIC) != MULTIPC_ATOMIC)
+		migrate_rings(data, node);
+}
+
+/* Places the buffers of an entry on a node, or makes them follow the consumer (NUMA_NO_NODE) */
+static int set_node(prodcons *data, int node) {
+	if (node != NUMA_NO_NODE && (node < 0 || node >= nr_node_ids || !node_online(node)))
+		return -EINVAL;
+
+	/* Enters the critical section */
+	if (down_interruptible(&data->mtx))
+		return -EINTR;
+
+	data->node = node;
+	data->remote = 0;
+
+	if (node != NUMA_NO_NODE && node != data->ring_node)
+		migrate_rings(data, node);
+
+	/* Exit the critical section */
+	up(&data->mtx);
+
+	return 0;
+}
+
+/* Returns the sub-queue of a producer, creating it if needed. Must be called inside the critical section */
+static struct producer *get_producer(prodcons *data, pid_t pid, gfp_t gfp) {
+	struct producer *p;
+
+	list_for_each_entry(p, &data->producers, links) {
+		if (p->pid == pid)
+			return p;
+	}
+
+	if (!(p = kmalloc_node(sizeof(struct producer), gfp, ring_node(data))))
+		return NULL;
+
+	if (ring_alloc(data, &p->cbuf, ring_node(data), gfp)) {
+		kfree(p);
+		return NULL;
+	}
+
+	p->pid = pid;
+	p->weight = 1;
+	p->credit = 0;
+	list_add_tail(&p->links, &data->producers);
+
+	return p;
+}
+
+static void free_producer(prodcons *data, struct producer *p) {
+	item_t item;
+
+	while (kfifo_out(&p->cbuf, &item, sizeof(item_t)) == sizeof(item_t))
+		free_item(data, &item);
+
+	if (data->turn == p)
+		data->turn = NULL;
+
+	list_del(&p->links);
+	kfifo_free(&p->cbuf);
+	kfree(p);
+}
+
+/* Inserts at the end of the buffer, or of the producer's sub-queue in fair mode.
+Items produced in atomic context share the sub-queue of pid 0. Must be called inside the critical section */
+static int queue_in(prodcons *data, item_t *item, int flags) {
+	gfp_t gfp = (flags & MULTIPC_ATOMIC) == MULTIPC_ATOMIC ? GFP_ATOMIC : GFP_KERNEL;
+	struct producer *p;
+
+	data->used = 1;
+	item->stamp = jiffies;
+	if (data->type == 'k')
+		item->kv->stamp = item->stamp;
+
+	if (!data->fair) {
+		if (!kfifo_initialized(&data->cbuf) && ring_alloc(data, &data->cbuf, ring_node(data), gfp))
+			return -ENOMEM;
+
+		kfifo_in(&data->cbuf, item, sizeof(item_t));
 		return 0;
+	}
 
-	if (len > MAX_CHARS_KBUF) 
-		return -ENOSPC;
-	
-	if (copy_from_user(kbuf, buf, len)) 
-		return -EFAULT;
+	if (!(p = get_producer(data, (gfp == GFP_ATOMIC) ? 0 : task_tgid_vnr(current), gfp)))
+		return -ENOMEM;
 
-	kbuf[len] = '\0';
-	/* Update the file pointer */
-	*off += len; 
+	kfifo_in(&p->cbuf, item, sizeof(item_t));
+
+	return 0;
+}
+
+/* Extracts the first item of the buffer. In fair mode every producer with items gets,
+in turns, weight items consumed. Must be called inside the critical section */
+static int queue_out(prodcons *data, item_t *item) {
+	struct producer *p = data->turn, *prev = data->turn, *pos;
+
+	data->used = 1;
+
+	if (!data->fair)
+		return kfifo_out(&data->cbuf, item, sizeof(item_t)) == sizeof(item_t) ? 0 : -EINVAL;
+
+	if (!p || !p->credit || kfifo_is_empty(&p->cbuf)) {
+		/* The producer whose turn ended goes to the back of the line */
+		if (p)
+			list_move_tail(&p->links, &data->producers);
+
+		/* First producer in line with items, there's at least one */
+		p = NULL;
+		list_for_each_entry(pos, &data->producers, links) {
+			if (!kfifo_is_empty(&pos->cbuf)) {
+				p = pos;
+				break;
+			}
+		}
+
+		if (!p)
+			return -EINVAL;
+
+		p->credit = p->weight;
+		data->turn = p;
+
+		/* Sub-queues are freed once their turn ends empty, unless they have a weight */
+		if (prev && prev != p && kfifo_is_empty(&prev->cbuf) && prev->weight == 1)
+			free_producer(data, prev);
+	}
+
+	kfifo_out(&p->cbuf, item, sizeof(item_t));
+	p->credit--;
+
+	return 0;
+}
+
+static int item_expired(prodcons *data, item_t *item) {
+	unsigned long stamp = (data->type == 'k') ? item->kv->stamp : item->stamp;
+
+	return data->ttl_ms && time_after(jiffies, stamp + msecs_to_jiffies(data->ttl_ms));
+}
+
+/* Discards the expired items at the front of a buffer. Items already claimed by a consumer
+(through the elements semaphore) are left for it. Must be called inside the critical section */
+static void expire_queue(prodcons *data, struct kfifo *cbuf) {
+	item_t item;
+
+	while (kfifo_out_peek(cbuf, &item, sizeof(item_t)) == sizeof(item_t) && item_expired(data, &item)) {
+		if (down_trylock(&data->elements))
+			return;
+
+		kfifo_out(cbuf, &item, sizeof(item_t));
+		if (data->type == 'k')
+			list_del(&item.kv->links);
+		free_item(data, &item);
+		data->expired++;
+
+		/* Increment the number of gaps */
+		up(&data->gaps);
+	}
+}
+
+/* Must be called inside the critical section */
+static void expire_items(prodcons *data) {
+	struct producer *p;
+
+	if (!data->ttl_ms)
+		return;
+
+	expire_queue(data, &data->cbuf);
+
+	list_for_each_entry(p, &data->producers, links)
+		expire_queue(data, &p->cbuf);
+}
+
+/* Turns fair mode on or off, only while there are no queued items */
+static int set_fair(prodcons *data, int fair) {
+	struct producer *p, *aux;
+	int r = 0;
+
+	/* Enters the critical section */
+	if (down_interruptible(&data->mtx))
+		return -EINTR;
+
+	list_for_each_entry(p, &data->producers, links) {
+		if (!kfifo_is_empty(&p->cbuf))
+			r = -EBUSY;
+	}
+
+	if (!kfifo_is_empty(&data->cbuf))
+		r = -EBUSY;
+
+	if (!r) {
+		if (!fair) {
+			list_for_each_entry_safe(p, aux, &data->producers, links)
+				free_producer(data, p);
+		}
+		data->fair = fair;
+	}
+
+	/* Exit the critical section */
+	up(&data->mtx);
+
+	return r;
+}
+
+/* Sets how many items of a producer are consumed on each of its turns */
+static int set_weight(prodcons *data, pid_t pid, unsigned int weight) {
+	struct producer *p;
+	int r = 0;
+
+	if (weight < 1)
+		return -EINVAL;
+
+	/* Enters the critical section */
+	if (down_interruptible(&data->mtx))
+		return -EINTR;
+
+	if (!data->fair)
+		r = -EINVAL;
+	else if (!(p = get_producer(data, pid, GFP_KERNEL)))
+		r = -ENOMEM;
+	else
+		p->weight = weight;
+
+	/* Exit the critical section */
+	up(&data->mtx);
+
+	return r;
+}
+
+/* Adds the pending items to the elements semaphore */
+static enum hrtimer_restart wakeup_timer(struct hrtimer *timer) {
+	struct wakeup *wk = container_of(timer, struct wakeup, timer);
+	unsigned long flags;
+	unsigned int n;
+
+	spin_lock_irqsave(&wk->lock, flags);
+	n = wk->pending;
+	wk->pending = 0;
+	spin_unlock_irqrestore(&wk->lock, flags);
+
+	if (n == 0)
+		return HRTIMER_NORESTART;
+
+	while (n--)
+		up(wk->elements);
+
+	/* The pipeline lock isn't irq-safe, so the kick goes through a work */
+	queue_work(pipe_wq, &wk->kick);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Makes a new item available to consumers, right away or once enough of them are queued.
+Must be called inside the critical section */
+static void publish_item(prodcons *data) {
+	struct wakeup *wk = data->wakeup;
+	unsigned long flags;
+	unsigned int n = 0;
+
+	if (!wk) {
+		/* Increment the number of elements */
+		up(&data->elements);
+		return;
+	}
+
+	spin_lock_irqsave(&wk->lock, flags);
+
+	if (++wk->pending >= wk->batch) {
+		n = wk->pending;
+		wk->pending = 0;
+		hrtimer_try_to_cancel(&wk->timer);
+	}
+	else if (wk->pending == 1)
+		hrtimer_start(&wk->timer, ns_to_ktime((u64)wk->usecs * NSEC_PER_USEC), HRTIMER_MODE_REL);
+
+	spin_unlock_irqrestore(&wk->lock, flags);
+
+	while (n--)
+		up(&data->elements);
+}
+
+static void kick_pipeline(prodcons *data, int out);
+
+static void wakeup_kick(struct work_struct *work) {
+	struct wakeup *wk = container_of(work, struct wakeup, kick);
+
+	kick_pipeline(wk->data, 1);
+}
+
+/* Publishes the pending items and stops coalescing. Must be called inside the critical section */
+static void free_wakeup(prodcons *data) {
+	struct wakeup *wk = data->wakeup;
+	unsigned int n;
+
+	if (!wk)
+		return;
+
+	hrtimer_cancel(&wk->timer);
+	cancel_work_sync(&wk->kick);
+
+	for (n = wk->pending; n > 0; --n)
+		up(&data->elements);
+
+	data->wakeup = NULL;
+
+	/* Items published now, or by the timer whose kick was cancelled */
+	kick_pipeline(data, 1);
+
+	kfree(wk);
+}
+
+/* Wake consumers every batch items or usecs microseconds, a batch of 1 wakes them on every item */
+static int set_wakeup(prodcons *data, unsigned int batch, unsigned int usecs) {
+	struct wakeup *wk = NULL;
+
+	if (batch == 0 || (batch > 1 && usecs == 0))
+		return -EINVAL;
+
+	if (batch > 1 && !(wk = kmalloc(sizeof(struct wakeup), GFP_KERNEL)))
+		return -ENOMEM;
+
+	/* Enters the critical section */
+	if (down_interruptible(&data->mtx)) {
+		kfree(wk);
+		return -EINTR;
+	}
+
+	free_wakeup(data);
+
+	if (wk) {
+		wk->batch = batch;
+		wk->usecs = usecs;
+		wk->pending = 0;
+		wk->elements = &data->elements;
+		wk->data = data;
+		INIT_WORK(&wk->kick, wakeup_kick);
+		spin_lock_init(&wk->lock);
+		hrtimer_init(&wk->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		wk->timer.function = wakeup_timer;
+		data->wakeup = wk;
+	}
+
+	/* Exit the critical section */
+	up(&data->mtx);
+
+	return 0;
+}
+
+/* Schedules the pipeline that takes items from (out) or puts items into an entry, if there's one */
+static void kick_pipeline(prodcons *data, int out) {
+	struct pipeline *pl;
+
+	if (!READ_ONCE(out ? data->pipe_out : data->pipe_in))
+		return;
+
+	spin_lock_bh(&data->pipe_lock);
+
+	if ((pl = out ? data->pipe_out : data->pipe_in))
+		queue_work(pipe_wq, &pl->work);
+
+	spin_unlock_bh(&data->pipe_lock);
+}
+
+/* Enters the critical section. With MULTIPC_ATOMIC it fails instead of sleeping */
+static int enter_mtx(prodcons *data, int flags) {
+	if ((flags & MULTIPC_ATOMIC) == MULTIPC_ATOMIC)
+		return down_trylock(&data->mtx) ? -EAGAIN : 0;
+
+	return down_interruptible(&data->mtx) ? -EINTR : 0;
+}
+
+/* Inserts an item for which a gap has already been taken */
+static int insert_item(prodcons *data, item_t *item, int flags) {
+	int r;
+
+	/* Values of 'a' entries are just added to the aggregates */
+	if (data->type == 'a') {
+		agg_add(data->agg, item->val);
+		up(&data->gaps);
+		return 0;
+	}
+
+	/* Enter the critical section */
+	if ((r = enter_mtx(data, flags))) {
+		up(&data->gaps);
+		return r;
+	}
+
+	/* Another producer may have queued the same key while we were blocked */
+	if (data->type == 'k' && coalesce_keyed(data, item->kv)) {
+		up(&data->mtx);
+		up(&data->gaps);
+		return 0;
+	}
+
+	/* Secure insertion in the circular buffer */
+	if (queue_in(data, item, flags)) {
+		up(&data->mtx);
+		up(&data->gaps);
+		return -ENOMEM;
+	}
+
+	if (data->type == 'k')
+		list_add_tail(&item->kv->links, &data->keyed);
+
+	publish_item(data);
+
+	/* Exit the critical section */
+	up(&data->mtx);
+
+	kick_pipeline(data, 1);
+
+	return 0;
+}
+
+/* Inserts an item in the circular buffer, blocking while it is full unless MULTIPC_NONBLOCK is set */
+static int produce_item(prodcons *data, item_t *item, int flags) {
+	int coalesced, r;
+
+	/* 'a' entries never fill up */
+	if (data->type == 'a') {
+		agg_add(data->agg, item->val);
+		return 0;
+	}
+
+	/* Latest value wins: a queued item with the same key doesn't need a new gap */
+	if (data->type == 'k') {
+		if ((r = enter_mtx(data, flags)))
+			return r;
+
+		coalesced = coalesce_keyed(data, item->kv);
+
+		up(&data->mtx);
+
+		if (coalesced)
+			return 0;
+	}
+
+	/* Expired items don't take up space */
+	if (data->ttl_ms && !enter_mtx(data, flags)) {
+		expire_items(data);
+		up(&data->mtx);
+	}
+
+	/* Blocks until there's free space */
+	if (flags & MULTIPC_NONBLOCK) {
+		if (down_trylock(&data->gaps))
+			return -EAGAIN;
+	}
+	else if (down_interruptible(&data->gaps))
+		return -EINTR;
+
+	return insert_item(data, item, flags);
+}
+
+/* Extracts the first item of the circular buffer that has not expired,
+blocking while it is empty unless MULTIPC_NONBLOCK is set */
+static int consume_item(prodcons *data, item_t *item, int flags) {
+	int r, expired;
+
+	do {
+		/* Blocks until there are elements to consume */
+		if (flags & MULTIPC_NONBLOCK) {
+			if (down_trylock(&data->elements))
+				return -EAGAIN;
+		}
+		else if (down_interruptible(&data->elements))
+			return -EINTR;
+
+		/* Enters the critical section */
+		if ((r = enter_mtx(data, flags))) {
+			up(&data->elements);
+			return r;
+		}
+
+		/* Extract the first element of the buffer */
+		r = queue_out(data, item);
+
+		if (data->type == 'k' && !r)
+			list_del(&item->kv->links);
+
+		if (!r)
+			follow_consumer(data, flags);
+
+		if ((expired = (!r && item_expired(data, item)))) {
+			free_item(data, item);
+			data->expired++;
+		}
+
+		/* Exit the critical section */
+		up(&data->mtx);
+
+		/* Increment the number of gaps */
+		up(&data->gaps);
+	} while (expired);
+
+	kick_pipeline(data, 0);
+
+	return r;
+}
+
+/* Moves items from the source to the destination of a pipeline while there are items
+and gaps. It's scheduled again when any of them changes */
+static void forward_items(struct work_struct *work) {
+	struct pipeline *pl = container_of(work, struct pipeline, work);
+	item_t item;
+
+	for (;;) {
+		/* Take the gap first, so there's no need to put the item back */
+		if (down_trylock(&pl->dst->gaps))
+			break;
+
+		if (consume_item(pl->src, &item, MULTIPC_NONBLOCK)) {
+			up(&pl->dst->gaps);
+			break;
+		}
+
+		if (pl->op == 'f' && (item.val < pl->a || item.val > pl->b)) {
+			up(&pl->dst->gaps);
+			continue;
+		}
+		else if (pl->op == 'm')
+			item.val = item.val * pl->a + pl->b;
+
+		if (insert_item(pl->dst, &item, 0))
+			free_item(pl->dst, &item);
+
+		cond_resched();
+	}
+}
+
+/* Connects two entries of the same type, or an 'i' entry to an 'a' one. Must be called with sem_list held */
+static int add_pipeline(prodcons *src, prodcons *dst, char op, int a, int b) {
+	struct pipeline *pl;
+	prodcons *pos;
+
+	if ((src->type != dst->type && !(src->type == 'i' && dst->type == 'a'))
+			|| (op && src->type != 'i') || src->pipe_out || dst->pipe_in)
+		return -EINVAL;
+
+	/* Items must not go round in circles */
+	for (pos = dst; pos; pos = pos->pipe_out ? pos->pipe_out->dst : NULL) {
+		if (pos == src)
+			return -EINVAL;
+	}
+
+	if (!(pl = kmalloc(sizeof(struct pipeline), GFP_KERNEL)))
+		return -ENOMEM;
+
+	pl->src = src;
+	pl->dst = dst;
+	pl->op = op;
+	pl->a = a;
+	pl->b = b;
+	INIT_WORK(&pl->work, forward_items);
+
+	spin_lock_bh(&src->pipe_lock);
+	src->pipe_out = pl;
+	spin_unlock_bh(&src->pipe_lock);
+
+	spin_lock_bh(&dst->pipe_lock);
+	dst->pipe_in = pl;
+	spin_unlock_bh(&dst->pipe_lock);
+
+	/* Forward what is already queued */
+	queue_work(pipe_wq, &pl->work);
+
+	return 0;
+}
+
+/* Disconnects a pipeline and waits for it to stop. Must be called with sem_list held */
+static void del_pipeline(struct pipeline *pl) {
+	if (!pl)
+		return;
+
+	spin_lock_bh(&pl->src->pipe_lock);
+	pl->src->pipe_out = NULL;
+	spin_unlock_bh(&pl->src->pipe_lock);
+
+	spin_lock_bh(&pl->dst->pipe_lock);
+	pl->dst->pipe_in = NULL;
+	spin_unlock_bh(&pl->dst->pipe_lock);
+
+	cancel_work_sync(&pl->work);
+	kfree(pl);
+}
+
+static ssize_t prodcons_write(struct file *filp, const char __user *buf, size_t len, loff_t *off) {
+	prodcons* data = (prodcons*)PDE_DATA(filp->f_inode);
+	char kbuf[MAX_CHARS_KBUF+1];
+	item_t item;
+	int n, r;
+
+	/* The application can write in this entry just once !! */
+	if ((*off) > 0) 
+		return 0;
+
+	/* Strings are copied straight into their chain, without going through kbuf */
+	if (data->type == 's') {
+		if (len > MAX_CHARS_ITEM)
+			return -ENOSPC;
+
+		if (!(item.str = chain_alloc(len, GFP_KERNEL)))
+			return -ENOMEM;
+
+		if (chain_copy_from_user(item.str, buf)) {
+			chain_free(item.str);
+			return -EFAULT;
+		}
+
+		*off += len;
+
+		if ((r = produce_item(data, &item, 0))) {
+			chain_free(item.str);
+			return r;
+		}
+
+		printk(KERN_INFO "Multipc: %s produced %zu bytes\n", data->name, len);
+
+		return len;
+	}
+
+	if (len > MAX_CHARS_KBUF) 
+		return -ENOSPC;
+	
+	if (copy_from_user(kbuf, buf, len)) 
+		return -EFAULT;
+
+	kbuf[len] = '\0';
+	/* Update the file pointer */
+	*off += len; 
+
+	if (data->type == 'i' || data->type == 'a') {
+		if (sscanf(kbuf, "%i", &item.val) != 1)
+			return -EINVAL;
+	}
+	else if (data->type == 'k') {
+		/* "key value": the value is the rest of the line */
+		item.kv = kmalloc(sizeof(struct keyed_item), GFP_KERNEL);
+		if (!item.kv)
+			return -ENOMEM;
+
+		/* A key longer than MAX_CHARS_KEY-1 is rejected, not split with the value */
+		if (sscanf(kbuf, "%9s%n", item.kv->key, &n) != 1 || !isspace(kbuf[n])) {
+			kfree(item.kv);
+			return -EINVAL;
+		}
+
+		while (isspace(kbuf[n]))
+			n++;
+
+		if (kbuf[n] == '\0') {
+			kfree(item.kv);
+			return -EINVAL;
+		}
+
+		item.kv->val = kmalloc(len-n+1, GFP_KERNEL);
+		if (!item.kv->val) {
+			kfree(item.kv);
+			return -ENOMEM;
+		}
+		strcpy(item.kv->val, kbuf+n);
+	}
+
+	if ((r = produce_item(data, &item, 0))) {
+		free_item(data, &item);
+		return r;
+	}
+
+	if (data->type == 'i' || data->type == 'a')
+		printk(KERN_INFO "Multipc: %s produced %d\n", data->name, item.val);
+	else
+		printk(KERN_INFO "Multipc: %s produced %s", data->name, kbuf);
+
+	return len;
+}
+
+
+/* Streams an item of an 's' entry: the first read extracts it from the buffer
+and the following ones go on copying it where the previous one stopped */
+static ssize_t prodcons_read_str(prodcons *data, struct reader *rd, char __user *buf, size_t len, loff_t *off) {
+	size_t nr_bytes, str_bytes;
+	item_t item;
+	int r;
+
+	if (!rd->str) {
+		/* The whole item has already been read */
+		if ((*off) > 0)
+			return 0;
+
+		if ((r = consume_item(data, &item, 0)))
+			return r;
+
+		rd->str = item.str;
+		rd->pos = 0;
+		rd->len = chain_len(item.str) + 1;
+
+		printk(KERN_INFO "Multipc: %s consumed %zu bytes\n", data->name, rd->len - 1);
+	}
+
+	nr_bytes = min(len, rd->len - rd->pos);
+	/* Everything but the final '\n' comes from the chain */
+	str_bytes = min(nr_bytes, rd->len - 1 - rd->pos);
+
+	if (chain_copy_to_user(rd->str, rd->pos, buf, str_bytes))
+		return -EFAULT;
+
+	if (str_bytes < nr_bytes && copy_to_user(buf + str_bytes, "\n", 1))
+		return -EFAULT;
+
+	rd->pos += nr_bytes;
+	(*off) += nr_bytes;
+
+	if (rd->pos == rd->len) {
+		chain_free(rd->str);
+		rd->str = NULL;
+	}
+
+	return nr_bytes;
+}
+
+/* Reading an 'a' entry returns the aggregates instead of extracting an item, so it never blocks */
+static ssize_t prodcons_read_agg(prodcons *data, char __user *buf, size_t len, loff_t *off) {
+	char kbuff[96];
+	struct agg_bucket res;
+	int nr_bytes;
+
+	if ((*off) > 0)
+		return 0;
+
+	agg_get(data->agg, &res);
+
+	if (res.count)
+		nr_bytes = sprintf(kbuff, "count=%u sum=%lld min=%d max=%d\n", res.count, (long long)res.sum, res.min, res.max);
+	else
+		nr_bytes = sprintf(kbuff, "count=0 sum=0\n");
+
+	if (len < nr_bytes)
+		return -ENOSPC;
+
+	if (copy_to_user(buf, kbuff, nr_bytes))
+		return -EFAULT;
+
+	(*off) += nr_bytes;
+
+	return nr_bytes;
+}
+
+static ssize_t prodcons_read(struct file *filp, char __user *buf, size_t len, loff_t *off) {
+	prodcons* data = (prodcons*)PDE_DATA(filp->f_inode);
+	int nr_bytes = 0;
+	int r;
+	char kbuff[32] = "";
+	item_t item;
+
+	if (data->type == 's')
+		return prodcons_read_str(data, filp->private_data, buf, len, off);
+
+	if (data->type == 'a')
+		return prodcons_read_agg(data, buf, len, off);
+
+	if ((*off) > 0)
+		return 0;
+
+	if ((r = consume_item(data, &item, 0)))
+		return r;
+
+	/* Convert to character string for the user */
+	if (data->type == 'i')
+		nr_bytes = sprintf(kbuff, "%i\n", item.val);
+	else
+		nr_bytes = sprintf(kbuff, "%s %s\n", item.kv->key, item.kv->val);
+
+	free_item(data, &item);
+
+	if (len < nr_bytes)
+		return -ENOSPC;
+
+	if (copy_to_user(buf, kbuff, nr_bytes))
+		return -EINVAL;
+
+	(*off) += nr_bytes; 
+
+	if (data->type == 'i')
+		printk(KERN_INFO "Multipc: %s consumed %d\n", data->name, item.val);
+	else
+		printk(KERN_INFO "Multipc: %s consumed %s", data->name, kbuff);
+
+	return nr_bytes;
+}
+
+static int prodcons_open(struct inode *i, struct file *filp) {
+	if (!(filp->private_data = kzalloc(sizeof(struct reader), GFP_KERNEL)))
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int prodcons_release(struct inode *i, struct file *filp) {
+	struct reader *rd = filp->private_data;
+
+	/* The rest of an item that was not completely read is lost */
+	chain_free(rd->str);
+	kfree(rd);
+
+	return 0;
+}
+
+static const struct file_operations prodcons_fops = {
+	.open = prodcons_open,
+	.release = prodcons_release,
+	.read = prodcons_read,
+	.write = prodcons_write,
+};
+
+
+/* Frees every queued item and the buffer of an entry once its last reference is dropped.
+Its /proc file is removed before, when it leaves procDataTable */
+static void freeProdcons(struct kref *ref) {
+	prodcons *data = container_of(ref, prodcons, ref);
+	struct producer *p, *aux;
+	item_t item;
+
+	while (kfifo_out(&data->cbuf, &item, sizeof(item_t)) == sizeof(item_t))
+		free_item(data, &item);
+
+	list_for_each_entry_safe(p, aux, &data->producers, links)
+		free_producer(data, p);
+
+	free_wakeup(data);
+	kfifo_free(&data->cbuf);
+	kfree(data->agg);
+	kmem_cache_free(prodcons_cache, data);
+}
+
+
+/* Returns the entry with that name, or NULL if there's none. Must be called with sem_list held */
+static prodcons *findProc(const char *name) {
+	prodcons *data;
+
+	hash_for_each_possible(procDataTable, data, hnode, full_name_hash(NULL, name, strlen(name))) {
+		if (strcmp(name, data->name) == 0)
+			return data;
+	}
+
+	return NULL;
+}
+
+
+int removeProc(char *str){
+	prodcons *data;
+
+	/* "Acquires" the mutex */
+	if (down_interruptible(&sem_list))
+		return 0;
+
+	if ((data = findProc(str))) {
+		hash_del(&data->hnode);
+		--entries;
+
+		del_pipeline(data->pipe_out);
+		del_pipeline(data->pipe_in);
+	}
+
+	/* "Frees" the mutex */
+  	up(&sem_list);
+
+	if (data) {
+		remove_proc_entry(data->name, multipc_dir);
+		kref_put(&data->ref, freeProdcons);
+	}
+
+	return 1;
+}
+
+
+void cleanProcs(void) {
+	/* Variables needed for the for loop */
+	struct hlist_node *aux = NULL;
+	prodcons *data = NULL;
+	int bkt;
+
+	/* Module is being unloaded: nobody else can use the table */
+	down(&sem_list);
+	
+	/* Delete and frees space of all /procs */
+	hash_for_each_safe(procDataTable, bkt, aux, data, hnode) {
+		del_pipeline(data->pipe_out);
+		del_pipeline(data->pipe_in);
+	}
+
+	hash_for_each_safe(procDataTable, bkt, aux, data, hnode) {
+		hash_del(&data->hnode);
+		remove_proc_entry(data->name, multipc_dir);
+		kref_put(&data->ref, freeProdcons);
+		--entries;
+	}
+
+	/* "Frees" the mutex */
+  	up(&sem_list);
+}
+
+
+int exists(char *name) {
+	prodcons *data;
+
+	/* "Acquires" the mutex */
+	down(&sem_list);
+
+	data = findProc(name);
+
+	/* "Frees" the mutex */
+  	up(&sem_list);
+
+	return data != NULL;
+}
+
+
+/* Interface for other modules, see multipc.h */
+
+struct prodcons_s *multipc_get(const char *name) {
+	prodcons *data;
+
+	/* "Acquires" the mutex */
+	down(&sem_list);
+
+	if ((data = findProc(name)))
+		kref_get(&data->ref);
+
+	/* "Frees" the mutex */
+	up(&sem_list);
+
+	return data;
+}
+EXPORT_SYMBOL_GPL(multipc_get);
+
+void multipc_put(struct prodcons_s *data) {
+	kref_put(&data->ref, freeProdcons);
+}
+EXPORT_SYMBOL_GPL(multipc_put);
+
+int multipc_produce_int(struct prodcons_s *data, int val, int flags) {
+	item_t item;
+
+	if (data->type != 'i' && data->type != 'a')
+		return -EINVAL;
+
+	item.val = val;
+
+	return produce_item(data, &item, flags);
+}
+EXPORT_SYMBOL_GPL(multipc_produce_int);
+
+int multipc_consume_int(struct prodcons_s *data, int *val, int flags) {
+	item_t item;
+	int r;
+
+	if (data->type != 'i')
+		return -EINVAL;
+
+	if ((r = consume_item(data, &item, flags)))
+		return r;
+
+	*val = item.val;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(multipc_consume_int);
+
+int multipc_produce_str(struct prodcons_s *data, const char *str, size_t len, int flags) {
+	gfp_t gfp = (flags & MULTIPC_ATOMIC) == MULTIPC_ATOMIC ? GFP_ATOMIC : GFP_KERNEL;
+	struct chunk *c;
+	item_t item;
+	int r;
+
+	if (data->type != 's')
+		return -EINVAL;
+
+	if (len > MAX_CHARS_ITEM)
+		return -ENOSPC;
+
+	if (!(item.str = chain_alloc(len, gfp)))
+		return -ENOMEM;
+
+	for (c = item.str; c; c = c->next) {
+		memcpy(c->data, str, c->len);
+		str += c->len;
+	}
+
+	if ((r = produce_item(data, &item, flags)))
+		chain_free(item.str);
+
+	return r;
+}
+EXPORT_SYMBOL_GPL(multipc_produce_str);
+
+ssize_t multipc_consume_str(struct prodcons_s *data, char *buf, size_t len, int flags) {
+	struct chunk *c;
+	item_t item;
+	size_t total, n;
+	int r;
+
+	if (data->type != 's')
+		return -EINVAL;
+
+	if ((r = consume_item(data, &item, flags)))
+		return r;
+
+	total = chain_len(item.str);
+
+	for (c = item.str; c && len > 0; c = c->next) {
+		n = min(len, c->len);
+		memcpy(buf, c->data, n);
+		buf += n;
+		len -= n;
+	}
+
+	chain_free(item.str);
+
+	return total;
+}
+EXPORT_SYMBOL_GPL(multipc_consume_str);
+
+
+/* Creates the entry /proc/multipc/<name> of the given type */
+static int createProc(char *name, char type) {
+	prodcons *data = NULL;
+	int r = 0;
+
+	if (type != 'i' && type != 's' && type != 'k' && type != 'a')
+		return -EINVAL;
+
+	if (!(data = kmem_cache_alloc(prodcons_cache, GFP_KERNEL)))
+		return -ENOMEM;
+
+	initializeProdcons(data, type, name);
+
+	/* Aggregates of the last second by default */
+	if (type == 'a') {
+		if (!(data->agg = kmalloc(sizeof(struct aggregate), GFP_KERNEL))) {
+			kmem_cache_free(prodcons_cache, data);
+			return -ENOMEM;
+		}
+		spin_lock_init(&data->agg->lock);
+		agg_init(data->agg, 1000, 0);
+	}
+
+	/* "Acquires" the mutex */
+	down(&sem_list);
+
+	if (entries >= max_entries)
+		r = -ENOSPC;
+	else if (findProc(name))
+		r = -EINVAL;
+	else {
+		hash_add(procDataTable, &data->hnode, full_name_hash(NULL, name, strlen(name)));
+		++entries;
+	}
+
+	/* "Frees" the mutex */
+  	up(&sem_list);
+
+	if (r) {
+		kfree(data->agg);
+		kmem_cache_free(prodcons_cache, data);
+		return r;
+	}
+
+	if (!proc_create_data(name, 0666, multipc_dir, &prodcons_fops, data)) {
+		down(&sem_list);
+		hash_del(&data->hnode);
+		--entries;
+		up(&sem_list);
+
+		kfree(data->agg);
+		kmem_cache_free(prodcons_cache, data);
+		return -ENOMEM;
+	}
+
+	printk(KERN_INFO "Multipc: Added %s module (%c)\n", name, type);
+
+	return 0;
+}
+
+
+/* Discards expired items and frees the buffers left empty and unused since the previous check.
+They are allocated again when something is produced */
+static void reclaim_idle(struct work_struct *work) {
+	prodcons *data;
+	int bkt, nr_freed = 0;
+
+	/* "Acquires" the mutex */
+	down(&sem_list);
+
+	hash_for_each(procDataTable, bkt, data, hnode) {
+		/* Busy entries are not idle */
+		if (down_trylock(&data->mtx))
+			continue;
+
+		expire_items(data);
+
+		if (!data->used && kfifo_initialized(&data->cbuf) && kfifo_is_empty(&data->cbuf)) {
+			kfifo_free(&data->cbuf);
+			nr_freed++;
+		}
+		data->used = 0;
+
+		up(&data->mtx);
+	}
+
+	/* "Frees" the mutex */
+  	up(&sem_list);
+
+	if (nr_freed)
+		printk(KERN_INFO "Multipc: Freed %d idle buffers\n", nr_freed);
+
+	if (idle_ms)
+		schedule_delayed_work(&reclaim_work, msecs_to_jiffies(idle_ms));
+}
+
+
+/* Growing buffer holding a checkpoint being written, or the piece being read */
+struct dump {
+	char *buf;
+	size_t len, size;
+	size_t pos; /* Bytes of the piece already read */
+	int bkt; /* Bucket of procDataTable being dumped, -1 before the header */
+	unsigned int idx; /* Entries of that bucket already dumped */
+};
+
+/* Makes room for n more bytes at the end of the dump */
+static int dump_reserve(struct dump *d, size_t n) {
+	size_t size = d->size ? d->size : PAGE_SIZE;
+	char *aux;
+
+	if (d->len + n <= d->size)
+		return 0;
+
+	while (size < d->len + n)
+		size *= 2;
+
+	if (!(aux = vmalloc(size)))
+		return -ENOMEM;
+
+	if (d->buf) {
+		memcpy(aux, d->buf, d->len);
+		vfree(d->buf);
+	}
+	d->buf = aux;
+	d->size = size;
+
+	return 0;
+}
+
+static int dump_put(struct dump *d, const void *src, size_t n) {
+	if (dump_reserve(d, n))
+		return -ENOMEM;
+
+	memcpy(d->buf + d->len, src, n);
+	d->len += n;
+
+	return 0;
+}
+
+/* Strings are stored as their length followed by the characters, without '\0' */
+static int dump_str(struct dump *d, char *str, size_t lenbytes) {
+	u16 len = strlen(str);
+	u8 len8 = len;
+
+	if ((lenbytes == sizeof(u8) ? dump_put(d, &len8, sizeof(u8)) : dump_put(d, &len, sizeof(u16))))
+		return -ENOMEM;
+
+	return dump_put(d, str, len);
+}
+
+/* Chains are stored as a u32 length followed by the bytes of every chunk */
+static int dump_chain(struct dump *d, struct chunk *c) {
+	u32 len = chain_len(c);
+
+	if (dump_put(d, &len, sizeof(u32)))
+		return -ENOMEM;
+
+	for (; c; c = c->next) {
+		if (dump_put(d, c->data, c->len))
+			return -ENOMEM;
+	}
+
+	return 0;
+}
 
-	if (data->isInt) {
-		if (sscanf(kbuf, "%i", &val) != 1)
-			return -EINVAL;
+static int dump_item(struct dump *d, prodcons *data, item_t *item) {
+	s32 val;
+
+	if (data->type == 'i' || data->type == 'a') {
+		val = item->val;
+		return dump_put(d, &val, sizeof(s32));
 	}
-	else {
-		str = vmalloc(len+1);
-		strcpy(str, kbuf);
+	else if (data->type == 'k') {
+		if (dump_str(d, item->kv->key, sizeof(u8)))
+			return -ENOMEM;
+		return dump_str(d, item->kv->val, sizeof(u16));
 	}
 
-	/* Blocks yntil there's free space */
-	if (down_interruptible(&data->gaps))
-		return -EINTR;
+	return dump_chain(d, item->str);
+}
 
-	/* Enter the critical section */
-	if (down_interruptible(&data->mtx)) {
-		up(&data->gaps);
+/* Copies the items of a buffer into items, leaving them in place. Returns how many there are */
+static unsigned int peek_queue(struct kfifo *cbuf, item_t *items) {
+	unsigned int nr_items;
+
+	/* Take every item out and put them back in the same order */
+	nr_items = kfifo_out(cbuf, items, kfifo_len(cbuf)) / sizeof(item_t);
+	kfifo_in(cbuf, items, nr_items*sizeof(item_t));
+
+	return nr_items;
+}
+
+/* Appends an entry: name, type, number of items and the queued items, which are left in the buffer.
+In fair mode the sub-queues are stored one after the other */
+static int dump_entry(struct dump *d, prodcons *data) {
+	struct producer *p;
+	item_t *items = NULL;
+	size_t size;
+	u32 nr_items = 0, i;
+	u8 type = data->type;
+	int r = 0;
+
+	/* Enters the critical section */
+	if (down_interruptible(&data->mtx))
 		return -EINTR;
+
+	/* Room for what is queued now, whatever max_size the entry was created with */
+	size = kfifo_len(&data->cbuf);
+	list_for_each_entry(p, &data->producers, links)
+		size += kfifo_len(&p->cbuf);
+
+	if (size && !(items = vmalloc(size))) {
+		up(&data->mtx);
+		return -ENOMEM;
 	}
 
-	/* Secure insertion in the circular buffer */
-	if (data->isInt) 	
-		kfifo_in(&data->cbuf, &val, sizeof(int));
-	else 
-		kfifo_in(&data->cbuf, &str, sizeof(char*));	
+	if (items)
+		nr_items = peek_queue(&data->cbuf, items);
+
+	list_for_each_entry(p, &data->producers, links) {
+		if (items)
+			nr_items += peek_queue(&p->cbuf, items + nr_items);
+	}
+
+	if (dump_str(d, data->name, sizeof(u8)) || dump_put(d, &type, sizeof(u8))
+			|| dump_put(d, &nr_items, sizeof(u32)))
+		r = -ENOMEM;
+
+	for (i = 0; !r && i < nr_items; ++i)
+		r = dump_item(d, data, &items[i]);
 
 	/* Exit the critical section */
 	up(&data->mtx);
 
-	/* Increment the number of elements */
-	up(&data->elements);
-
-	if (data->isInt)
-		printk(KERN_INFO "Multipc: %s produced %d\n", data->name, val);
-	else
-		printk(KERN_INFO "Multipc: %s produced %s", data->name, str);
+	vfree(items);
 
-	return len;
+	return r;
 }
 
+/* Takes a reference to the next entry to dump, or returns NULL after the last one.
+Entries created or deleted meanwhile may be missed */
+static prodcons *dump_next_entry(struct dump *d) {
+	prodcons *data;
+	unsigned int i;
 
-static ssize_t prodcons_read(struct file *filp, char __user *buf, size_t len, loff_t *off) {
-	prodcons* data = (prodcons*)PDE_DATA(filp->f_inode);
-	int nr_bytes = 0;
-	int val = 0;
-	int bytes_extracted;
-	char kbuff[32] = "";
-	char *str = NULL;
+	/* "Acquires" the mutex */
+	if (down_interruptible(&sem_list))
+		return ERR_PTR(-EINTR);
+
+	for (; d->bkt < HASH_SIZE(procDataTable); d->bkt++, d->idx = 0) {
+		i = 0;
+		hlist_for_each_entry(data, &procDataTable[d->bkt], hnode) {
+			if (i++ == d->idx) {
+				d->idx++;
+				kref_get(&data->ref);
+				up(&sem_list);
+				return data;
+			}
+		}
+	}
 
-	if ((*off) > 0)
-		return 0;
+	/* "Frees" the mutex */
+  	up(&sem_list);
 
-	/* Blocks until there are elements to consume */
-	if (down_interruptible(&data->elements))
-		return -EINTR;
+	return NULL;
+}
 
-	/* Enters the critical section */
-	if (down_interruptible(&data->mtx)) {
-		up(&data->elements);
-		return -EINTR;
+/* The checkpoint is produced a piece at a time as it's read, so only one entry is held
+in memory and sem_list is only taken to find it:
+ * u32 magic, and for each entry u8 name length, name, u8 type, u32 number of items and
+ * the items, ended by a name of length 0. Items are a s32 ('i'), u32 length and characters ('s'),
+ * or u8 key length, key, u16 value length and value ('k').
+Returns the length of the next piece, 0 at the end */
+static int dump_next(struct dump *d) {
+	u32 magic = CHECKPOINT_MAGIC;
+	u8 end = 0;
+	prodcons *data;
+	int r;
+
+	d->len = d->pos = 0;
+
+	if (d->bkt < 0) {
+		d->bkt = 0;
+		r = dump_put(d, &magic, sizeof(u32));
+	}
+	/* The end was already given */
+	else if (d->bkt > HASH_SIZE(procDataTable))
+		return 0;
+	else if (IS_ERR(data = dump_next_entry(d)))
+		return PTR_ERR(data);
+	else if (data) {
+		r = dump_entry(d, data);
+		multipc_put(data);
+	}
+	else {
+		d->bkt++;
+		r = dump_put(d, &end, sizeof(u8));
 	}
 
-	/* Extract the first element of the buffer */
-	if (data->isInt)
-		bytes_extracted = kfifo_out(&data->cbuf, &val, sizeof(int));
-	else 
-		bytes_extracted = kfifo_out(&data->cbuf, &str, sizeof(char*));
+	return r ? r : d->len;
+}
 
-	/* Exit the critical section */
-	up(&data->mtx);
 
-	/* Increment the number of gaps */
-	up(&data->gaps);
+/* Cursor over a checkpoint being restored */
+struct undump {
+	const char *buf;
+	size_t len, pos;
+};
 
-	if ((data->isInt && bytes_extracted != sizeof(int)) || (!data->isInt && bytes_extracted != sizeof(char*)))
+static int undump_get(struct undump *u, void *dst, size_t n) {
+	if (u->pos + n > u->len)
 		return -EINVAL;
 
-	/* Convert to character string for the user */
-	if (data->isInt)
-		nr_bytes = sprintf(kbuff, "%i\n", val);
-	else {
-		nr_bytes = sprintf(kbuff, "%s\n", str);
-		vfree(str);
-	}
+	memcpy(dst, u->buf + u->pos, n);
+	u->pos += n;
 
-	if (len < nr_bytes)
-		return -ENOSPC;
+	return 0;
+}
 
-	if (copy_to_user(buf, kbuff, nr_bytes))
-		return -EINVAL;
+/* Reads a string shorter than max into dst, or into a new kmalloc'ed buffer if dst is NULL */
+static char *undump_str(struct undump *u, size_t lenbytes, char *dst, size_t max) {
+	u16 len = 0;
+	u8 len8;
 
-	(*off) += nr_bytes; 
+	if (lenbytes == sizeof(u8)) {
+		if (undump_get(u, &len8, sizeof(u8)))
+			return NULL;
+		len = len8;
+	}
+	else if (undump_get(u, &len, sizeof(u16)))
+		return NULL;
 
-	if (data->isInt)
-		printk(KERN_INFO "Multipc: %s consumed %d\n", data->name, val);
-	else
-		printk(KERN_INFO "Multipc: %s consumed %s", data->name, str);
+	if (u->pos + len > u->len || len >= max)
+		return NULL;
 
-	return nr_bytes;
+	if (!dst && !(dst = kmalloc(len+1, GFP_KERNEL)))
+		return NULL;
+
+	undump_get(u, dst, len);
+	dst[len] = '\0';
+
+	return dst;
 }
 
-static const struct file_operations prodcons_fops = {
-	.read = prodcons_read,
-	.write = prodcons_write,
-};
+static struct chunk *undump_chain(struct undump *u) {
+	struct chunk *head, *c;
+	u32 len;
 
+	if (undump_get(u, &len, sizeof(u32)) || len > MAX_CHARS_ITEM || u->pos + len > u->len)
+		return NULL;
 
-void addProc(prodcons *data) {
-	int r;
+	if (!(head = chain_alloc(len, GFP_KERNEL)))
+		return NULL;
 
-	/* Initialize node */
-	struct list_item *node = vmalloc(sizeof(struct list_item));
-	node->data = data;
+	for (c = head; c; c = c->next)
+		undump_get(u, c->data, c->len);
 
-	/* "Acquires" the mutex */
-	r = down_interruptible(&sem_list);
+	return head;
+}
 
-	/* Adds the node at the end of the list */
-	list_add_tail(&node->links, &procDataList);
+static int undump_item(struct undump *u, prodcons *data, item_t *item) {
+	s32 val;
 
-	/* "Frees" the mutex */
-  	up(&sem_list);
+	if (data->type == 'i' || data->type == 'a') {
+		if (undump_get(u, &val, sizeof(s32)))
+			return -EINVAL;
+		item->val = val;
+	}
+	else if (data->type == 'k') {
+		if (!(item->kv = kmalloc(sizeof(struct keyed_item), GFP_KERNEL)))
+			return -ENOMEM;
+
+		if (!undump_str(u, sizeof(u8), item->kv->key, MAX_CHARS_KEY)
+				|| !(item->kv->val = undump_str(u, sizeof(u16), NULL, MAX_CHARS_KBUF))) {
+			kfree(item->kv);
+			return -EINVAL;
+		}
+	}
+	else if (!(item->str = undump_chain(u)))
+		return -EINVAL;
 
-	++entries;
+	return 0;
 }
 
+/* Rebuilds the entries of a checkpoint. Items go after the ones already queued,
+and the ones that don't fit in the buffer are dropped */
+static int restoreProcs(const char *buf, size_t len) {
+	struct undump u = { buf, len, 0 };
+	char name[MAX_CHARS_ADMIN];
+	u32 magic, nr_entries = 0, nr_items, j;
+	u8 type;
+	prodcons *data;
+	item_t item;
+	int r, dropped = 0;
 
-int removeProc(char *str){
-	/* Auxiliar pointers for the for loop */
-	struct list_head *aux = NULL, *pos = NULL;
-	/* Node to be freed */
-	struct list_item *node = NULL;
-	char *freestr = NULL;
-	int bytes_extracted;
-	int r;
+	if (undump_get(&u, &magic, sizeof(u32)) || magic != CHECKPOINT_MAGIC)
+		return -EINVAL;
 
-	/* "Acquires" the mutex */
-	r = down_interruptible(&sem_list);
-	
-	/* Delete and free space of /proc */
-	list_for_each_safe(pos, aux, &procDataList){
-		node = list_entry(pos, struct list_item, links);
-		if (strcmp(str, node->data->name) == 0) {
-			/* "Frees" the mutex */
-  			up(&sem_list);
+	for (;; ++nr_entries) {
+		if (!undump_str(&u, sizeof(u8), name, MAX_CHARS_ADMIN))
+			return -EINVAL;
+
+		/* End of the checkpoint */
+		if (name[0] == '\0')
+			break;
 
-			if (!node->data->isInt) {
-				while (kfifo_len(&node->data->cbuf) > 0) {
-					/* Enters the critical section */
-					if (down_interruptible(&node->data->mtx))
-						return 0;
+		if (undump_get(&u, &type, sizeof(u8)) || undump_get(&u, &nr_items, sizeof(u32)))
+			return -EINVAL;
 
-					bytes_extracted = kfifo_out(&node->data->cbuf, &freestr, sizeof(char *));
+		/* The reference keeps the entry alive if it's deleted meanwhile */
+		if (!(data = multipc_get(name))) {
+			if ((r = createProc(name, type)))
+				return r;
+			if (!(data = multipc_get(name)))
+				return -EINVAL;
+		}
 
-					/* Exit the critical section */
-					up(&node->data->mtx);
+		r = (data->type != type) ? -EINVAL : 0;
 
-					/* Increment the number of gaps */
-					up(&node->data->gaps);
+		for (j = 0; !r && j < nr_items; ++j) {
+			if ((r = undump_item(&u, data, &item)))
+				break;
 
-					vfree(freestr);
+			if ((r = produce_item(data, &item, MULTIPC_NONBLOCK))) {
+				free_item(data, &item);
+				if (r == -EAGAIN) {
+					dropped++;
+					r = 0;
 				}
 			}
-			kfifo_free(&node->data->cbuf);
-			remove_proc_entry(node->data->name, multipc_dir);
-			vfree(node->data);
-			
-			/* "Acquires" the mutex */
-			r = down_interruptible(&sem_list);
-
-			list_del(pos);
-			vfree(node);
-			--entries;
 		}
+
+		multipc_put(data);
+
+		if (r)
+			return r;
 	}
 
-	/* "Frees" the mutex */
-  	up(&sem_list);
+	printk(KERN_INFO "Multipc: Restored %u entries (%d items dropped)\n", nr_entries, dropped);
 
-	return 1;
+	return 0;
 }
 
 
-void cleanProcs(void) {
-	/* Variables needed for the for loop */
-	struct list_head *aux = NULL, *pos = NULL;
-	/* Node to be freed */
-	struct list_item *node = NULL;
-	char *str = NULL;
-	int bytes_extracted, r;
+/* Readers of /proc/multipc/checkpoint get a checkpoint of every entry, built as they read it, 
+writers give one to restore when they close it, and close() returns the result */
+static int checkpoint_open(struct inode *i, struct file *filp) {
+	struct dump *d = vzalloc(sizeof(struct dump));
 
-	/* "Acquires" the mutex */
-	r = down_interruptible(&sem_list);
-	
-	/* Delete and frees space of all /procs */
-	list_for_each_safe(pos, aux, &procDataList){
-		node = list_entry(pos, struct list_item, links);
+	if (!d)
+		return -ENOMEM;
 
-		/* "Frees" the mutex */
-  		up(&sem_list);
-		if (!node->data->isInt) {
-			while (kfifo_len(&node->data->cbuf) > 0) {
-				/* Enters the critical section */
-				r = down_interruptible(&node->data->mtx);
+	/* The same buffer would hold the checkpoint being written and the one being read */
+	if ((filp->f_mode & FMODE_READ) && (filp->f_mode & FMODE_WRITE)) {
+		vfree(d);
+		return -EINVAL;
+	}
 
-				bytes_extracted = kfifo_out(&node->data->cbuf, &str, sizeof(char *));
+	if (filp->f_mode & FMODE_READ)
+		d->bkt = -1;
 
-				/* Exit the critical section */
-				up(&node->data->mtx);
+	filp->private_data = d;
 
-				/* Increment the number of gaps */
-				up(&node->data->gaps);
+	return 0;
+}
 
-				vfree(str);
-			}
-		}
-		kfifo_free(&node->data->cbuf);
-		remove_proc_entry(node->data->name, multipc_dir);
-		vfree(node->data);
-		
-		/* "Acquires" the mutex */
-		r = down_interruptible(&sem_list);
-
-		list_del(pos);
-		vfree(node);
-		--entries;
-	}
+static ssize_t checkpoint_read(struct file *filp, char __user *buf, size_t len, loff_t *off) {
+	struct dump *d = filp->private_data;
+	size_t nr_bytes;
+	int r;
 
-	/* "Frees" the mutex */
-  	up(&sem_list);
+	/* Dumps the next piece once the previous one has been read */
+	if (d->pos == d->len && (r = dump_next(d)) <= 0)
+		return r;
+
+	nr_bytes = min(len, d->len - d->pos);
+
+	if (copy_to_user(buf, d->buf + d->pos, nr_bytes))
+		return -EFAULT;
+
+	d->pos += nr_bytes;
+	(*off) += nr_bytes;
+
+	return nr_bytes;
 }
 
+static ssize_t checkpoint_write(struct file *filp, const char __user *buf, size_t len, loff_t *off) {
+	struct dump *d = filp->private_data;
 
-int exists(char *name) {
-	int exists = 0; 
-	/* Variable needed for the loop */
-	struct list_head *pos = NULL;
-	/* Variable that will retrieve the node */
-	struct list_item *node = NULL;
-	int r;
+	if (dump_reserve(d, len))
+		return -ENOMEM;
 
-	/* "Acquires" the mutex */
-	r = down_interruptible(&sem_list);
+	if (copy_from_user(d->buf + d->len, buf, len))
+		return -EFAULT;
 
-	list_for_each(pos, &procDataList) {
-		node = list_entry(pos, struct list_item, links);
-		if (!exists && strcmp(name, node->data->name) == 0)
-			exists = 1;
-	}
+	d->len += len;
+	(*off) += len;
 
-	/* "Frees" the mutex */
-  	up(&sem_list);
+	return len;
+}
+
+/* The restore happens on flush, the last point where its error reaches the writer */
+static int checkpoint_flush(struct file *filp, fl_owner_t id) {
+	struct dump *d = filp->private_data;
+	int r = 0;
+
+	if (!(filp->f_mode & FMODE_WRITE) || d->len == 0)
+		return 0;
+
+	if ((r = restoreProcs(d->buf, d->len)))
+		printk(KERN_WARNING "Multipc: Couldn't restore the checkpoint (%d)\n", r);
+
+	/* Only once, even if the file is shared and closed again */
+	d->len = 0;
 
-	return exists;
+	return r;
 }
 
+static int checkpoint_release(struct inode *i, struct file *filp) {
+	struct dump *d = filp->private_data;
+
+	vfree(d->buf);
+	vfree(d);
+
+	return 0;
+}
+
+static const struct file_operations checkpoint_fops = {
+	.open = checkpoint_open,
+	.llseek = no_llseek,
+	.read = checkpoint_read,
+	.write = checkpoint_write,
+	.flush = checkpoint_flush,
+	.release = checkpoint_release,
+};
+
 
 static ssize_t admin_write(struct file *filp, const char __user *buf, size_t len, loff_t *off) {
-	char kbuf[MAX_CHARS_ADMIN+1];
-	char name[MAX_CHARS_ADMIN];
-	char type;
-	static struct proc_dir_entry *proc_entry;
-	prodcons* data = NULL;
+	char kbuf[MAX_CHARS_CMD+1];
+	char name[MAX_CHARS_CMD+1], dst[MAX_CHARS_CMD+1];
+	char type, mode[16], op = '\0';
+	unsigned long flags;
+	prodcons *data;
+	unsigned int num;
+	int pid, a = 0, b = 0, r;
 
 	/* The application can write in this entry just once !! */
 	if ((*off) > 0) 
 		return 0;
 
-	if (len > MAX_CHARS_ADMIN) 
+	if (len > MAX_CHARS_CMD) 
 		return -ENOSPC;
 	
 	if (copy_from_user(kbuf, buf, len)) 
@@ -371,41 +2072,126 @@ static ssize_t admin_write(struct file *filp, const char __user *buf, size_t len
 	/* Update the file pointer */
 	*off += len; 
 
+	/* Names are the second word of every command */
+	if (sscanf(kbuf, "%*s %s", name) == 1 && strlen(name) >= MAX_CHARS_ADMIN)
+		return -EINVAL;
+
 	if (sscanf(kbuf, "new %s %c", name, &type) == 2) {
-		if (entries >= max_entries)
-			return -ENOSPC;
+		if ((r = createProc(name, type)))
+			return r;
+	}
+	else if (sscanf(kbuf, "delete %s", name) == 1) {
+		if (!exists(name))
+			return -EINVAL;
 
-		if (exists(name))
+		if (!removeProc(name))
+			return -EINTR;
+
+		printk(KERN_INFO "Multipc: Removed %s module\n", name);
+	}
+	else if (sscanf(kbuf, "fair %s %3s", name, mode) == 2) {
+		if ((strcmp(mode, "on") != 0 && strcmp(mode, "off") != 0) || !(data = multipc_get(name)))
+			return -EINVAL;
+
+		r = set_fair(data, strcmp(mode, "on") == 0);
+		multipc_put(data);
+
+		if (r)
+			return r;
+	}
+	else if (sscanf(kbuf, "pipe %s %s", name, dst) == 2) {
+		/* pipe <src> <dst> [filter <min> <max> | map <mul> <add>] */
+		if (sscanf(kbuf, "pipe %*s %*s filter %d %d", &a, &b) == 2)
+			op = 'f';
+		else if (sscanf(kbuf, "pipe %*s %*s map %d %d", &a, &b) == 2)
+			op = 'm';
+		else if (sscanf(kbuf, "pipe %*s %*s %c", &op) == 1)
 			return -EINVAL;
 
-		data = vmalloc(sizeof(prodcons));
+		down(&sem_list);
+
+		if (!(data = findProc(name)) || strlen(dst) >= MAX_CHARS_ADMIN || !findProc(dst))
+			r = -EINVAL;
+		else
+			r = add_pipeline(data, findProc(dst), op, a, b);
+
+		up(&sem_list);
+
+		if (r)
+			return r;
+	}
+	else if (sscanf(kbuf, "unpipe %s", name) == 1) {
+		down(&sem_list);
+
+		if ((data = findProc(name)))
+			del_pipeline(data->pipe_out);
+
+		up(&sem_list);
+
+		if (!data)
+			return -EINVAL;
+	}
+	else if (sscanf(kbuf, "window %s %u %15s", name, &num, mode) == 3) {
+		/* window <name> <ms> tumbling|sliding */
+		if (num == 0 || (strcmp(mode, "tumbling") != 0 && strcmp(mode, "sliding") != 0)
+				|| !(data = multipc_get(name)))
+			return -EINVAL;
 
-		if (type == 'i') {
-			if (initializeProdcons(data, 1, name))
-				return -ENOMEM;
+		r = -EINVAL;
+		if (data->type == 'a') {
+			spin_lock_irqsave(&data->agg->lock, flags);
+			agg_init(data->agg, num, strcmp(mode, "sliding") == 0);
+			spin_unlock_irqrestore(&data->agg->lock, flags);
+			r = 0;
 		}
-    	else if (type == 's') {
-    		if (initializeProdcons(data, 0, name))
-				return -ENOMEM;
-    	}
-    	else {
-    		vfree(data);
-    		return -EINVAL;
-    	}
+		multipc_put(data);
+
+		if (r)
+			return r;
+	}
+	else if (sscanf(kbuf, "wakeup %s %u %d", name, &num, &a) == 3) {
+		/* wakeup <name> <items> <usecs> */
+		if (a < 0 || !(data = multipc_get(name)))
+			return -EINVAL;
 
-    	proc_entry = proc_create_data(name, 0666, multipc_dir, &prodcons_fops, data);
-    	addProc(data);
+		r = set_wakeup(data, num, a);
+		multipc_put(data);
 
-    	printk(KERN_INFO "Multipc: Added %s module (%c)\n", name, type);
+		if (r)
+			return r;
 	}
-	else if (sscanf(kbuf, "delete %s", name) == 1) {
-		if (!exists(name))
+	else if (sscanf(kbuf, "ttl %s %u", name, &num) == 2) {
+		if (!(data = multipc_get(name)))
 			return -EINVAL;
 
-		if (!removeProc(name))
-			return -EINTR;
+		data->ttl_ms = num;
+		multipc_put(data);
+	}
+	else if (sscanf(kbuf, "node %s %15s", name, mode) == 2) {
+		/* node <name> <n>|auto */
+		if (strcmp(mode, "auto") == 0)
+			a = NUMA_NO_NODE;
+		else if (kstrtoint(mode, 10, &a) || a < 0)
+			return -EINVAL;
 
-		printk(KERN_INFO "Multipc: Removed %s module\n", name);
+		if (!(data = multipc_get(name)))
+			return -EINVAL;
+
+		r = set_node(data, a);
+		multipc_put(data);
+
+		if (r)
+			return r;
+	}
+	else if (sscanf(kbuf, "weight %s %d %u", name, &pid, &num) == 3) {
+		if (!(data = multipc_get(name)))
+			return -EINVAL;
+
+		r = set_weight(data, pid, num);
+		multipc_put(data);
+
+		if (r)
+			return r;
 	}
 	else
 		return -EINVAL;
@@ -415,6 +2201,83 @@ static ssize_t admin_write(struct file *filp, const char __user *buf, size_t len
 
 
 
+/* Number of items in the buffer and sub-queues of an entry */
+/* Must be called inside the critical section: sub-queues are freed when their producer goes idle */
+static unsigned int queued_items(prodcons *data) {
+	struct producer *p;
+	unsigned int n = kfifo_len(&data->cbuf);
+
+	list_for_each_entry(p, &data->producers, links)
+		n += kfifo_len(&p->cbuf);
+
+	return n / sizeof(item_t);
+}
+
+/* /proc/multipc/stats lists the entries one bucket of the hash table at a time */
+static void *stats_bucket(loff_t *pos) {
+	for (; *pos < HASH_SIZE(procDataTable); ++(*pos)) {
+		if (!hlist_empty(&procDataTable[*pos]))
+			return &procDataTable[*pos];
+	}
+
+	return NULL;
+}
+
+static void *stats_start(struct seq_file *m, loff_t *pos) {
+	/* "Acquires" the mutex, stats_stop() frees it */
+	down(&sem_list);
+
+	return stats_bucket(pos);
+}
+
+static void *stats_next(struct seq_file *m, void *v, loff_t *pos) {
+	++(*pos);
+
+	return stats_bucket(pos);
+}
+
+static void stats_stop(struct seq_file *m, void *v) {
+	/* "Frees" the mutex */
+  	up(&sem_list);
+}
+
+static int stats_show(struct seq_file *m, void *v) {
+	prodcons *data;
+
+	hlist_for_each_entry(data, (struct hlist_head *)v, hnode) {
+		/* Doesn't wait for producers and consumers blocked inside the critical section */
+		if (down_trylock(&data->mtx)) {
+			seq_printf(m, "%s %c busy\n", data->name, data->type);
+			continue;
+		}
+
+		seq_printf(m, "%s %c queued=%u coalesced=%u ttl_ms=%u expired=%lu node=%d\n", data->name, data->type,
+			queued_items(data), data->coalesced, data->ttl_ms, data->expired, data->ring_node);
+		up(&data->mtx);
+	}
+
+	return 0;
+}
+
+static const struct seq_operations stats_seq_ops = {
+	.start = stats_start,
+	.next = stats_next,
+	.stop = stats_stop,
+	.show = stats_show,
+};
+
+static int stats_open(struct inode *i, struct file *filp) {
+	return seq_open(filp, &stats_seq_ops);
+}
+
+static const struct file_operations stats_fops = {
+	.open = stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release,
+};
+
+
 static const struct file_operations admin_fops = {
 	.write = admin_write,
 };
@@ -423,49 +2286,90 @@ static const struct file_operations admin_fops = {
 
 
 int init_multipc_module(void) {
-	static struct proc_dir_entry *proc_entry;
-	prodcons *data;
+	void *dump = NULL;
+	loff_t dump_size;
+	int r;
 
 	if (max_entries < 1 || (max_size & (max_size - 1)) != 0)
 		return -EINVAL;
 
-	/* Initialize the list */
-	INIT_LIST_HEAD(&procDataList);
+	/* Initialize the hash table */
+	hash_init(procDataTable);
 
-	/* Initializing the semaphore that allows mutual exclusion of the linked list to 1 */
+	if (!(prodcons_cache = KMEM_CACHE(prodcons_s, SLAB_HWCACHE_ALIGN)))
+		return -ENOMEM;
+
+	/* Pipelines forward items from their own workqueue */
+	if (!(pipe_wq = alloc_workqueue("multipc_pipes", WQ_UNBOUND, 0))) {
+		kmem_cache_destroy(prodcons_cache);
+		return -ENOMEM;
+	}
+
+	/* Initializing the semaphore that allows mutual exclusion of the hash table to 1 */
     sema_init(&sem_list, 1);
 
     /* Create proc directory */
     multipc_dir = proc_mkdir("multipc",NULL);
 
-    if (!multipc_dir) 
+    if (!multipc_dir) {
+        destroy_workqueue(pipe_wq);
+        kmem_cache_destroy(prodcons_cache);
         return -ENOMEM;
+    }
 
     /* Create proc entry /proc/multipc/admin */
 	admin_entry = proc_create("admin", 0666, multipc_dir, &admin_fops);
 
 	if (admin_entry == NULL) {
         remove_proc_entry("multipc", NULL);
+        destroy_workqueue(pipe_wq);
+        kmem_cache_destroy(prodcons_cache);
         return -ENOMEM;
     }
 
-    data = vmalloc(sizeof(prodcons));
-	
-	if (initializeProdcons(data, 1, "test"))
-		return -ENOMEM;
-
-    /* Create proc entry /proc/multipc/test */
-	proc_entry = proc_create_data("test", 0666, multipc_dir, &prodcons_fops, data);
+    /* Create proc entry /proc/multipc/checkpoint */
+    if (proc_create("checkpoint", 0600, multipc_dir, &checkpoint_fops) == NULL) {
+        remove_proc_entry("admin", multipc_dir);
+        remove_proc_entry("multipc", NULL);
+        destroy_workqueue(pipe_wq);
+        kmem_cache_destroy(prodcons_cache);
+        return -ENOMEM;
+    }
 
-    if (proc_entry == NULL) {
+    /* Create proc entry /proc/multipc/stats */
+    if (proc_create("stats", 0444, multipc_dir, &stats_fops) == NULL) {
+        remove_proc_entry("checkpoint", multipc_dir);
         remove_proc_entry("admin", multipc_dir);
         remove_proc_entry("multipc", NULL);
-        kfifo_free(&data->cbuf);
-        vfree(data);
+        destroy_workqueue(pipe_wq);
+        kmem_cache_destroy(prodcons_cache);
         return -ENOMEM;
     }
 
-    addProc(data);
+    /* Create proc entry /proc/multipc/test */
+    if ((r = createProc("test", 'i'))) {
+        remove_proc_entry("stats", multipc_dir);
+        remove_proc_entry("checkpoint", multipc_dir);
+        remove_proc_entry("admin", multipc_dir);
+        remove_proc_entry("multipc", NULL);
+        destroy_workqueue(pipe_wq);
+        kmem_cache_destroy(prodcons_cache);
+        return r;
+    }
+
+    /* Rebuild the entries saved before the module was unloaded */
+    if (restore_file) {
+        if ((r = kernel_read_file_from_path(restore_file, &dump, &dump_size, 0, READING_UNKNOWN)) == 0) {
+            r = restoreProcs(dump, dump_size);
+            vfree(dump);
+        }
+
+        if (r)
+            printk(KERN_WARNING "Multipc: Couldn't restore %s (%d)\n", restore_file, r);
+    }
+
+    if (idle_ms)
+        schedule_delayed_work(&reclaim_work, msecs_to_jiffies(idle_ms));
 
     printk(KERN_INFO "Multipc: Module loaded\n");
 
@@ -474,11 +2378,20 @@ int init_multipc_module(void) {
 
 
 void exit_multipc_module(void) {
+    /* Stop checking for idle buffers */
+    idle_ms = 0;
+    cancel_delayed_work_sync(&reclaim_work);
+
 	/* Remove all the entries of the multipc dir */
     cleanProcs();
+    remove_proc_entry("stats", multipc_dir);
+    remove_proc_entry("checkpoint", multipc_dir);
     remove_proc_entry("admin", multipc_dir);
     remove_proc_entry("multipc", NULL);
     
+    destroy_workqueue(pipe_wq);
+    kmem_cache_destroy(prodcons_cache);
+
     printk(KERN_INFO "Multipc: Modules removed\n");
 }
 
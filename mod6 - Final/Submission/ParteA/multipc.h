@@ -0,0 +1,33 @@
+#ifndef _MULTIPC_H
+#define _MULTIPC_H
+
+#include <linux/types.h>
+
+/* In-kernel interface of the multipc module, so other modules can produce and
+consume items of an entry without going through its /proc file */
+
+/* Return -EAGAIN instead of waiting for items or gaps */
+#define MULTIPC_NONBLOCK	0x1
+/* Never sleep, not even for the lock of the entry, and allocate with GFP_ATOMIC.
+Implies MULTIPC_NONBLOCK, for callers in softirq context (timers, tasklets, NAPI...) */
+#define MULTIPC_ATOMIC	(0x2 | MULTIPC_NONBLOCK)
+
+struct prodcons_s;
+
+/* Returns a handle of the entry with that name, or NULL if there's none. The entry stays
+valid until multipc_put() even if it's deleted from /proc/multipc/admin meanwhile.
+Both may sleep */
+struct prodcons_s *multipc_get(const char *name);
+void multipc_put(struct prodcons_s *entry);
+
+/* 'i' and 'a' entries */
+int multipc_produce_int(struct prodcons_s *entry, int val, int flags);
+/* 'i' entries */
+int multipc_consume_int(struct prodcons_s *entry, int *val, int flags);
+
+/* 's' entries. Consuming copies at most len bytes of the item, without a final '\0',
+and returns its whole length, so a larger result means it didn't fit */
+int multipc_produce_str(struct prodcons_s *entry, const char *str, size_t len, int flags);
+ssize_t multipc_consume_str(struct prodcons_s *entry, char *buf, size_t len, int flags);
+
+#endif